@@ -11,6 +11,7 @@
 #pragma once
 
 #include <JuceHeader.h>
+#include <complex>
 
 //==============================================================================
 /**
@@ -25,163 +26,5518 @@ enum class PluginState
 
 //==============================================================================
 /**
- * Pitch detector class using YIN algorithm
+ * Radix-2 complex FFT plan with precomputed twiddles and bit-reversal table
  */
-class PitchDetector
+class FFTPlan
 {
 public:
-    PitchDetector(double sampleRate, int bufferSize)
-        : sampleRate(sampleRate), bufferSize(bufferSize)
+    explicit FFTPlan(int fftSize)
+        : size(fftSize)
     {
-        yinBuffer.resize(bufferSize / 2);
+        jassert(juce::isPowerOfTwo(size));
+
+        // Precompute the twiddle factors for the largest butterfly stage
+        twiddles.resize(size / 2);
+        for (int i = 0; i < size / 2; ++i)
+        {
+            const double angle = -2.0 * juce::MathConstants<double>::pi * i / size;
+            twiddles[i] = { std::cos(angle), std::sin(angle) };
+        }
+
+        // Precompute the bit-reversed permutation
+        int numBits = 0;
+        while ((1 << numBits) < size)
+            ++numBits;
+
+        bitReversed.resize(size);
+        for (int i = 0; i < size; ++i)
+        {
+            int reversed = 0;
+            for (int bit = 0; bit < numBits; ++bit)
+                if (i & (1 << bit))
+                    reversed |= 1 << (numBits - 1 - bit);
+
+            bitReversed[i] = reversed;
+        }
     }
 
-    float detectPitch(const float* buffer, int size)
+    void perform(std::complex<double>* data, bool inverse) const
     {
-        // YIN algorithm for pitch detection
-        // Step 1: Calculate difference function
-        for (int tau = 0; tau < yinBuffer.size(); tau++)
+        // Reorder the input into bit-reversed order
+        for (int i = 0; i < size; ++i)
+            if (i < bitReversed[i])
+                std::swap(data[i], data[bitReversed[i]]);
+
+        // Iterative butterflies
+        for (int length = 2; length <= size; length <<= 1)
+        {
+            const int halfLength = length / 2;
+            const int twiddleStep = size / length;
+
+            for (int start = 0; start < size; start += length)
+            {
+                for (int k = 0; k < halfLength; ++k)
+                {
+                    auto w = twiddles[k * twiddleStep];
+                    if (inverse)
+                        w = std::conj(w);
+
+                    const auto even = data[start + k];
+                    const auto odd = data[start + k + halfLength] * w;
+
+                    data[start + k] = even + odd;
+                    data[start + k + halfLength] = even - odd;
+                }
+            }
+        }
+
+        if (inverse)
+        {
+            const double scale = 1.0 / size;
+            for (int i = 0; i < size; ++i)
+                data[i] *= scale;
+        }
+    }
+
+    int getSize() const { return size; }
+
+private:
+    int size;
+    std::vector<std::complex<double>> twiddles;
+    std::vector<int> bitReversed;
+};
+
+//==============================================================================
+/**
+ * Radix-2 complex FFT for a size fixed at compile time. Every loop bound is a
+ * constant, so the butterflies can be unrolled and vectorised. The twiddles
+ * and the bit-reversed permutation are fixed-size tables built once per size
+ * at runtime, on the first call to prepare() or perform().
+ */
+template <int Size>
+class FixedSizeFFT
+{
+public:
+    static_assert(Size >= 4 && (Size & (Size - 1)) == 0, "FFT size must be a power of two");
+
+    /** Builds the tables ahead of the first perform(), so that doesn't pay for them on the audio thread */
+    static void prepare()
+    {
+        getTables();
+    }
+
+    static void perform(std::complex<double>* data, bool inverse)
+    {
+        const auto& tables = getTables();
+
+        // Reorder the input into bit-reversed order
+        for (int i = 0; i < Size; ++i)
+            if (i < tables.bitReversed[i])
+                std::swap(data[i], data[tables.bitReversed[i]]);
+
+        // Iterative butterflies, with the complex product written out
+        const double direction = inverse ? -1.0 : 1.0;
+
+        for (int length = 2; length <= Size; length <<= 1)
+        {
+            const int halfLength = length / 2;
+            const int twiddleStep = Size / length;
+
+            for (int start = 0; start < Size; start += length)
+            {
+                for (int k = 0; k < halfLength; ++k)
+                {
+                    const double wr = tables.cosine[k * twiddleStep];
+                    const double wi = direction * tables.sine[k * twiddleStep];
+
+                    const auto even = data[start + k];
+                    const auto odd = data[start + k + halfLength];
+                    const std::complex<double> product { odd.real() * wr - odd.imag() * wi, odd.real() * wi + odd.imag() * wr };
+
+                    data[start + k] = even + product;
+                    data[start + k + halfLength] = even - product;
+                }
+            }
+        }
+
+        if (inverse)
+        {
+            const double scale = 1.0 / Size;
+            for (int i = 0; i < Size; ++i)
+                data[i] *= scale;
+        }
+    }
+
+private:
+    struct Tables
+    {
+        std::array<double, Size / 2> cosine {};
+        std::array<double, Size / 2> sine {};
+        std::array<int, Size> bitReversed {};
+    };
+
+    static Tables makeTables()
+    {
+        Tables result;
+
+        // w_k = exp(-2 pi i k / Size)
+        for (int k = 0; k < Size / 2; ++k)
         {
-            yinBuffer[tau] = 0.0f;
-            for (int j = 0; j < yinBuffer.size(); j++)
+            const double angle = 2.0 * juce::MathConstants<double>::pi * k / Size;
+            result.cosine[(size_t) k] = std::cos(angle);
+            result.sine[(size_t) k] = -std::sin(angle);
+        }
+
+        int numBits = 0;
+        while ((1 << numBits) < Size)
+            ++numBits;
+
+        for (int i = 0; i < Size; ++i)
+        {
+            int reversed = 0;
+            for (int bit = 0; bit < numBits; ++bit)
+                if (i & (1 << bit))
+                    reversed |= 1 << (numBits - 1 - bit);
+
+            result.bitReversed[(size_t) i] = reversed;
+        }
+
+        return result;
+    }
+
+    static const Tables& getTables()
+    {
+        static const Tables tables = makeTables();
+        return tables;
+    }
+};
+
+//==============================================================================
+/**
+ * SIMD kernels for the YIN inner loops, selected at runtime from the CPU features
+ */
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+ #define PITCHSAMPLER_SIMD_X86 1
+ #include <immintrin.h>
+ #if defined(__GNUC__) || defined(__clang__)
+  #define PITCHSAMPLER_TARGET(isa) __attribute__((target(isa)))
+ #else
+  #define PITCHSAMPLER_TARGET(isa)
+ #endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+ #define PITCHSAMPLER_SIMD_NEON 1
+ #include <arm_neon.h>
+#endif
+
+namespace YinKernels
+{
+    /** out[tau] = sum over j < windowLength of (buffer[j] - buffer[j + tau])^2, for firstLag <= tau < endLag */
+    using DifferenceFunction = void (*)(const float* buffer, float* out, int firstLag, int endLag, int windowLength);
+
+    /**
+     * In-place cumulative mean normalisation of yinBuffer[firstTau, endTau):
+     * sum += yinBuffer[tau], yinBuffer[tau] *= tau / sum. runningSum is the sum of
+     * yinBuffer[1, firstTau) before normalisation; returns the sum up to endTau.
+     */
+    using NormaliseFunction = float (*)(float* yinBuffer, int firstTau, int endTau, float runningSum);
+
+    /** Sum of taps[i] * (left[i] + right[i]) for i < numTaps: one output of the downmixing FIR */
+    using DownmixDotFunction = float (*)(const float* left, const float* right, const float* taps, int numTaps);
+
+    /** Sums and sign changes of a frame, for the energy / zero-crossing gate */
+    struct FrameStatistics
+    {
+        float sum = 0.0f;
+        float sumOfSquares = 0.0f;
+        int zeroCrossings = 0; // sign-bit changes between neighbouring samples
+    };
+
+    using FrameStatisticsFunction = FrameStatistics (*)(const float* buffer, int numSamples);
+
+    struct KernelTable
+    {
+        const char* name;
+        DifferenceFunction difference;
+        NormaliseFunction cumulativeMeanNormalise;
+        DownmixDotFunction downmixDot;
+        FrameStatisticsFunction frameStatistics;
+    };
+
+    //==============================================================================
+    // Scalar reference implementations
+
+    inline void differenceScalar(const float* buffer, float* out, int firstLag, int endLag, int windowLength)
+    {
+        for (int tau = firstLag; tau < endLag; ++tau)
+        {
+            float sum = 0.0f;
+            for (int j = 0; j < windowLength; ++j)
             {
                 float delta = buffer[j] - buffer[j + tau];
-                yinBuffer[tau] += delta * delta;
+                sum += delta * delta;
             }
+            out[tau] = sum;
         }
+    }
 
-        // Step 2: Cumulative mean normalized difference function
+    inline float normaliseScalar(float* yinBuffer, int firstTau, int endTau, float runningSum)
+    {
+        for (int tau = firstTau; tau < endTau; ++tau)
+        {
+            runningSum += yinBuffer[tau];
+            yinBuffer[tau] *= tau / runningSum;
+        }
+        return runningSum;
+    }
+
+    inline float downmixDotScalar(const float* left, const float* right, const float* taps, int numTaps)
+    {
         float sum = 0.0f;
-        yinBuffer[0] = 1.0f;
+        for (int i = 0; i < numTaps; ++i)
+            sum += taps[i] * (left[i] + right[i]);
+        return sum;
+    }
 
-        for (int tau = 1; tau < yinBuffer.size(); tau++)
+    /** Adds the statistics of buffer[0, numSamples) to partial (used for vector kernel tails) */
+    inline FrameStatistics accumulateFrameStatistics(const float* buffer, int numSamples, FrameStatistics partial)
+    {
+        for (int i = 0; i < numSamples; ++i)
         {
-            sum += yinBuffer[tau];
-            yinBuffer[tau] *= tau / sum;
+            partial.sum += buffer[i];
+            partial.sumOfSquares += buffer[i] * buffer[i];
+
+            if (i + 1 < numSamples && std::signbit(buffer[i]) != std::signbit(buffer[i + 1]))
+                ++partial.zeroCrossings;
         }
+        return partial;
+    }
+
+    inline FrameStatistics frameStatisticsScalar(const float* buffer, int numSamples)
+    {
+        return accumulateFrameStatistics(buffer, numSamples, {});
+    }
 
-        // Step 3: Find the first minimum below threshold
-        int tau = 2;
-        float threshold = 0.1f;
+    // The vector difference kernels process several lags per iteration, so every lane
+    // accumulates over j in the same order as the scalar loop. The cumulative mean
+    // kernels compute the running sum with an in-register prefix scan, carrying the
+    // last lane into the next block.
+
+#if PITCHSAMPLER_SIMD_X86
+    //==============================================================================
+    // SSE2
 
-        while (tau < yinBuffer.size())
+    PITCHSAMPLER_TARGET("sse2")
+    inline void differenceSSE2(const float* buffer, float* out, int firstLag, int endLag, int windowLength)
+    {
+        int tau = firstLag;
+        for (; tau + 4 <= endLag; tau += 4)
         {
-            if (yinBuffer[tau] < threshold &&
-                yinBuffer[tau] < yinBuffer[tau - 1] &&
-                yinBuffer[tau] < yinBuffer[tau + 1])
+            __m128 sum = _mm_setzero_ps();
+            for (int j = 0; j < windowLength; ++j)
             {
-                // Refine the estimate with parabolic interpolation
-                float alpha = yinBuffer[tau - 1];
-                float beta = yinBuffer[tau];
-                float gamma = yinBuffer[tau + 1];
-                float p = 0.5f * (alpha - gamma) / (alpha - 2.0f * beta + gamma);
+                const __m128 delta = _mm_sub_ps(_mm_set1_ps(buffer[j]), _mm_loadu_ps(buffer + j + tau));
+                sum = _mm_add_ps(sum, _mm_mul_ps(delta, delta));
+            }
+            _mm_storeu_ps(out + tau, sum);
+        }
+        differenceScalar(buffer, out, tau, endLag, windowLength);
+    }
 
-                // Return the frequency
-                return sampleRate / (tau + p);
+    PITCHSAMPLER_TARGET("sse2")
+    inline float normaliseSSE2(float* yinBuffer, int firstTau, int endTau, float runningSum)
+    {
+        __m128 carry = _mm_set1_ps(runningSum);
+        __m128 taus = _mm_setr_ps((float) firstTau, (float) (firstTau + 1), (float) (firstTau + 2), (float) (firstTau + 3));
+        const __m128 step = _mm_set1_ps(4.0f);
+
+        int tau = firstTau;
+        for (; tau + 4 <= endTau; tau += 4)
+        {
+            __m128 values = _mm_loadu_ps(yinBuffer + tau);
+            __m128 scan = _mm_add_ps(values, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(values), 4)));
+            scan = _mm_add_ps(scan, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(scan), 8)));
+            scan = _mm_add_ps(scan, carry);
+
+            _mm_storeu_ps(yinBuffer + tau, _mm_mul_ps(values, _mm_div_ps(taus, scan)));
+
+            carry = _mm_shuffle_ps(scan, scan, _MM_SHUFFLE(3, 3, 3, 3));
+            taus = _mm_add_ps(taus, step);
+        }
+
+        return normaliseScalar(yinBuffer, tau, endTau, _mm_cvtss_f32(carry));
+    }
+
+    PITCHSAMPLER_TARGET("sse2")
+    inline float downmixDotSSE2(const float* left, const float* right, const float* taps, int numTaps)
+    {
+        __m128 sum = _mm_setzero_ps();
+        int i = 0;
+        for (; i + 4 <= numTaps; i += 4)
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(taps + i), _mm_add_ps(_mm_loadu_ps(left + i), _mm_loadu_ps(right + i))));
+
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum) + downmixDotScalar(left + i, right + i, taps + i, numTaps - i);
+    }
+
+    PITCHSAMPLER_TARGET("sse2")
+    inline FrameStatistics frameStatisticsSSE2(const float* buffer, int numSamples)
+    {
+        __m128 sum = _mm_setzero_ps();
+        __m128 squares = _mm_setzero_ps();
+        __m128i crossings = _mm_setzero_si128();
+
+        // Each block also compares its last sample with the next block's first; the
+        // shifted-down sign bit of the xor counts one crossing per lane
+        int i = 0;
+        for (; i + 5 <= numSamples; i += 4)
+        {
+            const __m128 values = _mm_loadu_ps(buffer + i);
+            sum = _mm_add_ps(sum, values);
+            squares = _mm_add_ps(squares, _mm_mul_ps(values, values));
+            const __m128 signs = _mm_xor_ps(values, _mm_loadu_ps(buffer + i + 1));
+            crossings = _mm_add_epi32(crossings, _mm_srli_epi32(_mm_castps_si128(signs), 31));
+        }
+
+        float sums[4], squareSums[4];
+        int counts[4];
+        _mm_storeu_ps(sums, sum);
+        _mm_storeu_ps(squareSums, squares);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(counts), crossings);
+
+        FrameStatistics partial;
+        partial.sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+        partial.sumOfSquares = (squareSums[0] + squareSums[1]) + (squareSums[2] + squareSums[3]);
+        partial.zeroCrossings = counts[0] + counts[1] + counts[2] + counts[3];
+        return accumulateFrameStatistics(buffer + i, numSamples - i, partial);
+    }
+
+    //==============================================================================
+    // AVX2
+
+    PITCHSAMPLER_TARGET("avx2")
+    inline void differenceAVX2(const float* buffer, float* out, int firstLag, int endLag, int windowLength)
+    {
+        int tau = firstLag;
+        for (; tau + 8 <= endLag; tau += 8)
+        {
+            __m256 sum = _mm256_setzero_ps();
+            for (int j = 0; j < windowLength; ++j)
+            {
+                const __m256 delta = _mm256_sub_ps(_mm256_set1_ps(buffer[j]), _mm256_loadu_ps(buffer + j + tau));
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(delta, delta));
             }
-            tau++;
+            _mm256_storeu_ps(out + tau, sum);
         }
+        differenceScalar(buffer, out, tau, endLag, windowLength);
+    }
 
-        // If no pitch found
-        return 0.0f;
+    PITCHSAMPLER_TARGET("avx2")
+    inline float normaliseAVX2(float* yinBuffer, int firstTau, int endTau, float runningSum)
+    {
+        __m256 carry = _mm256_set1_ps(runningSum);
+        __m256 taus = _mm256_add_ps(_mm256_set1_ps((float) firstTau),
+                                    _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f));
+        const __m256 step = _mm256_set1_ps(8.0f);
+
+        int tau = firstTau;
+        for (; tau + 8 <= endTau; tau += 8)
+        {
+            const __m256 values = _mm256_loadu_ps(yinBuffer + tau);
+
+            // Scan within each 128-bit half, then add the low half's total to the high half
+            __m256 scan = _mm256_add_ps(values, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(values), 4)));
+            scan = _mm256_add_ps(scan, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(scan), 8)));
+            const __m256 lowTotal = _mm256_permute_ps(scan, _MM_SHUFFLE(3, 3, 3, 3));
+            scan = _mm256_add_ps(scan, _mm256_permute2f128_ps(lowTotal, lowTotal, 0x08));
+            scan = _mm256_add_ps(scan, carry);
+
+            _mm256_storeu_ps(yinBuffer + tau, _mm256_mul_ps(values, _mm256_div_ps(taus, scan)));
+
+            carry = _mm256_permutevar8x32_ps(scan, _mm256_set1_epi32(7));
+            taus = _mm256_add_ps(taus, step);
+        }
+
+        return normaliseScalar(yinBuffer, tau, endTau, _mm256_cvtss_f32(carry));
+    }
+
+    PITCHSAMPLER_TARGET("avx2,fma")
+    inline float downmixDotAVX2(const float* left, const float* right, const float* taps, int numTaps)
+    {
+        __m256 sum = _mm256_setzero_ps();
+        int i = 0;
+        for (; i + 8 <= numTaps; i += 8)
+            sum = _mm256_fmadd_ps(_mm256_loadu_ps(taps + i), _mm256_add_ps(_mm256_loadu_ps(left + i), _mm256_loadu_ps(right + i)), sum);
+
+        __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+        half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+        half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+        return _mm_cvtss_f32(half) + downmixDotScalar(left + i, right + i, taps + i, numTaps - i);
+    }
+
+    PITCHSAMPLER_TARGET("avx2")
+    inline FrameStatistics frameStatisticsAVX2(const float* buffer, int numSamples)
+    {
+        __m256 sum = _mm256_setzero_ps();
+        __m256 squares = _mm256_setzero_ps();
+        __m256i crossings = _mm256_setzero_si256();
+
+        int i = 0;
+        for (; i + 9 <= numSamples; i += 8)
+        {
+            const __m256 values = _mm256_loadu_ps(buffer + i);
+            sum = _mm256_add_ps(sum, values);
+            squares = _mm256_add_ps(squares, _mm256_mul_ps(values, values));
+            const __m256 signs = _mm256_xor_ps(values, _mm256_loadu_ps(buffer + i + 1));
+            crossings = _mm256_add_epi32(crossings, _mm256_srli_epi32(_mm256_castps_si256(signs), 31));
+        }
+
+        float sums[8], squareSums[8];
+        int counts[8];
+        _mm256_storeu_ps(sums, sum);
+        _mm256_storeu_ps(squareSums, squares);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(counts), crossings);
+
+        FrameStatistics partial;
+        for (int lane = 0; lane < 8; ++lane)
+        {
+            partial.sum += sums[lane];
+            partial.sumOfSquares += squareSums[lane];
+            partial.zeroCrossings += counts[lane];
+        }
+        return accumulateFrameStatistics(buffer + i, numSamples - i, partial);
+    }
+
+    //==============================================================================
+    // AVX-512
+
+    PITCHSAMPLER_TARGET("avx512f")
+    inline void differenceAVX512(const float* buffer, float* out, int firstLag, int endLag, int windowLength)
+    {
+        int tau = firstLag;
+        for (; tau + 16 <= endLag; tau += 16)
+        {
+            __m512 sum = _mm512_setzero_ps();
+            for (int j = 0; j < windowLength; ++j)
+            {
+                const __m512 delta = _mm512_sub_ps(_mm512_set1_ps(buffer[j]), _mm512_loadu_ps(buffer + j + tau));
+                sum = _mm512_add_ps(sum, _mm512_mul_ps(delta, delta));
+            }
+            _mm512_storeu_ps(out + tau, sum);
+        }
+        differenceScalar(buffer, out, tau, endLag, windowLength);
+    }
+
+    PITCHSAMPLER_TARGET("avx512f")
+    inline float normaliseAVX512(float* yinBuffer, int firstTau, int endTau, float runningSum)
+    {
+        __m512 carry = _mm512_set1_ps(runningSum);
+        __m512 taus = _mm512_add_ps(_mm512_set1_ps((float) firstTau),
+                                    _mm512_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f,
+                                                   8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f, 15.0f));
+        const __m512 step = _mm512_set1_ps(16.0f);
+        const __m512i zero = _mm512_setzero_si512();
+
+        int tau = firstTau;
+        for (; tau + 16 <= endTau; tau += 16)
+        {
+            const __m512 values = _mm512_loadu_ps(yinBuffer + tau);
+
+            // Shift lanes up by 1, 2, 4 and 8 (filling with zeros) and accumulate
+            __m512i scan = _mm512_castps_si512(values);
+            scan = _mm512_castps_si512(_mm512_add_ps(_mm512_castsi512_ps(scan), _mm512_castsi512_ps(_mm512_alignr_epi32(scan, zero, 15))));
+            scan = _mm512_castps_si512(_mm512_add_ps(_mm512_castsi512_ps(scan), _mm512_castsi512_ps(_mm512_alignr_epi32(scan, zero, 14))));
+            scan = _mm512_castps_si512(_mm512_add_ps(_mm512_castsi512_ps(scan), _mm512_castsi512_ps(_mm512_alignr_epi32(scan, zero, 12))));
+            scan = _mm512_castps_si512(_mm512_add_ps(_mm512_castsi512_ps(scan), _mm512_castsi512_ps(_mm512_alignr_epi32(scan, zero, 8))));
+            const __m512 total = _mm512_add_ps(_mm512_castsi512_ps(scan), carry);
+
+            _mm512_storeu_ps(yinBuffer + tau, _mm512_mul_ps(values, _mm512_div_ps(taus, total)));
+
+            carry = _mm512_permutexvar_ps(_mm512_set1_epi32(15), total);
+            taus = _mm512_add_ps(taus, step);
+        }
+
+        return normaliseScalar(yinBuffer, tau, endTau, _mm512_cvtss_f32(carry));
+    }
+
+    PITCHSAMPLER_TARGET("avx512f")
+    inline float downmixDotAVX512(const float* left, const float* right, const float* taps, int numTaps)
+    {
+        __m512 sum = _mm512_setzero_ps();
+        int i = 0;
+        for (; i + 16 <= numTaps; i += 16)
+            sum = _mm512_fmadd_ps(_mm512_loadu_ps(taps + i), _mm512_add_ps(_mm512_loadu_ps(left + i), _mm512_loadu_ps(right + i)), sum);
+
+        return _mm512_reduce_add_ps(sum) + downmixDotScalar(left + i, right + i, taps + i, numTaps - i);
+    }
+
+    PITCHSAMPLER_TARGET("avx512f")
+    inline FrameStatistics frameStatisticsAVX512(const float* buffer, int numSamples)
+    {
+        __m512 sum = _mm512_setzero_ps();
+        __m512 squares = _mm512_setzero_ps();
+        __m512i crossings = _mm512_setzero_si512();
+
+        int i = 0;
+        for (; i + 17 <= numSamples; i += 16)
+        {
+            const __m512 values = _mm512_loadu_ps(buffer + i);
+            sum = _mm512_add_ps(sum, values);
+            squares = _mm512_fmadd_ps(values, values, squares);
+
+            const __m512i signs = _mm512_xor_si512(_mm512_castps_si512(values), _mm512_castps_si512(_mm512_loadu_ps(buffer + i + 1)));
+            crossings = _mm512_add_epi32(crossings, _mm512_srli_epi32(signs, 31));
+        }
+
+        FrameStatistics partial;
+        partial.sum = _mm512_reduce_add_ps(sum);
+        partial.sumOfSquares = _mm512_reduce_add_ps(squares);
+        partial.zeroCrossings = _mm512_reduce_add_epi32(crossings);
+        return accumulateFrameStatistics(buffer + i, numSamples - i, partial);
+    }
+#endif
+
+#if PITCHSAMPLER_SIMD_NEON
+    //==============================================================================
+    // NEON
+
+    inline void differenceNEON(const float* buffer, float* out, int firstLag, int endLag, int windowLength)
+    {
+        int tau = firstLag;
+        for (; tau + 4 <= endLag; tau += 4)
+        {
+            float32x4_t sum = vdupq_n_f32(0.0f);
+            for (int j = 0; j < windowLength; ++j)
+            {
+                const float32x4_t delta = vsubq_f32(vdupq_n_f32(buffer[j]), vld1q_f32(buffer + j + tau));
+                sum = vaddq_f32(sum, vmulq_f32(delta, delta));
+            }
+            vst1q_f32(out + tau, sum);
+        }
+        differenceScalar(buffer, out, tau, endLag, windowLength);
+    }
+
+    inline float normaliseNEON(float* yinBuffer, int firstTau, int endTau, float runningSum)
+    {
+        float32x4_t carry = vdupq_n_f32(runningSum);
+        const float initialTaus[4] = { (float) firstTau, (float) (firstTau + 1), (float) (firstTau + 2), (float) (firstTau + 3) };
+        float32x4_t taus = vld1q_f32(initialTaus);
+        const float32x4_t step = vdupq_n_f32(4.0f);
+        const float32x4_t zero = vdupq_n_f32(0.0f);
+
+        int tau = firstTau;
+        for (; tau + 4 <= endTau; tau += 4)
+        {
+            const float32x4_t values = vld1q_f32(yinBuffer + tau);
+            float32x4_t scan = vaddq_f32(values, vextq_f32(zero, values, 3));
+            scan = vaddq_f32(scan, vextq_f32(zero, scan, 2));
+            scan = vaddq_f32(scan, carry);
+
+            // Division via reciprocal estimate plus two Newton-Raphson steps (no vdivq on ARMv7)
+            float32x4_t reciprocal = vrecpeq_f32(scan);
+            reciprocal = vmulq_f32(vrecpsq_f32(scan, reciprocal), reciprocal);
+            reciprocal = vmulq_f32(vrecpsq_f32(scan, reciprocal), reciprocal);
+
+            vst1q_f32(yinBuffer + tau, vmulq_f32(values, vmulq_f32(taus, reciprocal)));
+
+            carry = vdupq_n_f32(vgetq_lane_f32(scan, 3));
+            taus = vaddq_f32(taus, step);
+        }
+
+        return normaliseScalar(yinBuffer, tau, endTau, vgetq_lane_f32(carry, 0));
+    }
+
+    inline float downmixDotNEON(const float* left, const float* right, const float* taps, int numTaps)
+    {
+        float32x4_t sum = vdupq_n_f32(0.0f);
+        int i = 0;
+        for (; i + 4 <= numTaps; i += 4)
+            sum = vmlaq_f32(sum, vld1q_f32(taps + i), vaddq_f32(vld1q_f32(left + i), vld1q_f32(right + i)));
+
+        const float32x2_t pair = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+        return vget_lane_f32(vpadd_f32(pair, pair), 0) + downmixDotScalar(left + i, right + i, taps + i, numTaps - i);
     }
 
-    juce::String noteFromFrequency(float frequency)
-    {
-        if (frequency <= 0.0f)
-            return "No pitch detected";
+    inline FrameStatistics frameStatisticsNEON(const float* buffer, int numSamples)
+    {
+        float32x4_t sum = vdupq_n_f32(0.0f);
+        float32x4_t squares = vdupq_n_f32(0.0f);
+        uint32x4_t crossings = vdupq_n_u32(0);
+
+        int i = 0;
+        for (; i + 5 <= numSamples; i += 4)
+        {
+            const float32x4_t values = vld1q_f32(buffer + i);
+            sum = vaddq_f32(sum, values);
+            squares = vmlaq_f32(squares, values, values);
+
+            const uint32x4_t signs = veorq_u32(vreinterpretq_u32_f32(values), vreinterpretq_u32_f32(vld1q_f32(buffer + i + 1)));
+            crossings = vaddq_u32(crossings, vshrq_n_u32(signs, 31));
+        }
+
+        float sums[4], squareSums[4];
+        uint32_t counts[4];
+        vst1q_f32(sums, sum);
+        vst1q_f32(squareSums, squares);
+        vst1q_u32(counts, crossings);
+
+        FrameStatistics partial;
+        partial.sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+        partial.sumOfSquares = (squareSums[0] + squareSums[1]) + (squareSums[2] + squareSums[3]);
+        partial.zeroCrossings = (int) (counts[0] + counts[1] + counts[2] + counts[3]);
+        return accumulateFrameStatistics(buffer + i, numSamples - i, partial);
+    }
+#endif
+
+    //==============================================================================
+    inline const KernelTable& getScalarKernels()
+    {
+        static const KernelTable table { "Scalar", differenceScalar, normaliseScalar, downmixDotScalar, frameStatisticsScalar };
+        return table;
+    }
+
+    /** Returns the widest kernel set supported by the CPU we are running on */
+    inline const KernelTable& getBestKernels()
+    {
+        static const KernelTable& table = []() -> const KernelTable&
+        {
+           #if PITCHSAMPLER_SIMD_X86
+            static const KernelTable avx512 { "AVX-512", differenceAVX512, normaliseAVX512, downmixDotAVX512, frameStatisticsAVX512 };
+            static const KernelTable avx2 { "AVX2", differenceAVX2, normaliseAVX2, downmixDotAVX2, frameStatisticsAVX2 };
+            static const KernelTable sse2 { "SSE2", differenceSSE2, normaliseSSE2, downmixDotSSE2, frameStatisticsSSE2 };
+
+            if (juce::SystemStats::hasAVX512F())
+                return avx512;
+            if (juce::SystemStats::hasAVX2() && juce::SystemStats::hasFMA3())
+                return avx2;
+            if (juce::SystemStats::hasSSE2())
+                return sse2;
+           #elif PITCHSAMPLER_SIMD_NEON
+            static const KernelTable neon { "NEON", differenceNEON, normaliseNEON, downmixDotNEON, frameStatisticsNEON };
+            return neon;
+           #endif
+
+            return getScalarKernels();
+        }();
+
+        return table;
+    }
+}
+
+//==============================================================================
+/**
+ * Equal-tempered conversions between frequency and MIDI note, with
+ * A4 = 440Hz = 69th midi note
+ */
+namespace PitchConversion
+{
+    /** Fractional MIDI note of a frequency in Hz, which must be positive */
+    inline float midiNoteFromFrequency(float frequency)
+    {
+        return 12.0f * std::log2(frequency / 440.0f) + 69.0f;
+    }
+
+    /** Frequency in Hz of a fractional MIDI note */
+    inline float frequencyFromMidiNote(float midiNote)
+    {
+        return 440.0f * std::pow(2.0f, (midiNote - 69.0f) / 12.0f);
+    }
+}
+
+//==============================================================================
+/**
+ * Result of analysing a single frame
+ */
+struct PitchEstimate
+{
+    float frequency = 0.0f;  // Hz, 0 if no pitch was found
+    float confidence = 0.0f; // 1 - CMNDF value at the chosen lag
+    float rms = 0.0f;        // RMS level of the analysed frame, DC removed
+    bool voiced = false;     // false for gated frames and frames without a clear CMNDF minimum
+};
+
+/**
+ * Structure-of-arrays result of a batched analysis; frame i covers the
+ * windowSize samples starting hopSize * i samples into the analysed buffer
+ */
+struct PitchTrack
+{
+    std::vector<float> frequency;
+    std::vector<float> confidence;
+    std::vector<float> rms;
+    std::vector<juce::uint8> voiced;
+
+    int size() const { return (int) frequency.size(); }
+
+    void resize(int numFrames)
+    {
+        frequency.assign((size_t) numFrames, 0.0f);
+        confidence.assign((size_t) numFrames, 0.0f);
+        rms.assign((size_t) numFrames, 0.0f);
+        voiced.assign((size_t) numFrames, 0);
+    }
+
+    void set(int frame, const PitchEstimate& estimate)
+    {
+        frequency[(size_t) frame] = estimate.frequency;
+        confidence[(size_t) frame] = estimate.confidence;
+        rms[(size_t) frame] = estimate.rms;
+        voiced[(size_t) frame] = estimate.voiced ? 1 : 0;
+    }
+
+    PitchEstimate get(int frame) const
+    {
+        return { frequency[(size_t) frame], confidence[(size_t) frame], rms[(size_t) frame], voiced[(size_t) frame] != 0 };
+    }
+
+    /** Number of full windows in numSamples samples */
+    static int countFrames(int numSamples, int windowSize, int hopSize)
+    {
+        return numSamples < windowSize ? 0 : (numSamples - windowSize) / hopSize + 1;
+    }
+};
+
+//==============================================================================
+/**
+ * Pitch analysis settings, independent of the host's block size
+ */
+enum class PitchEngineType
+{
+    YIN,    // Cumulative mean normalised difference (de Cheveigne & Kawahara)
+    McLeod  // Normalised square difference with key-maximum picking (McLeod & Wyvill)
+};
+
+enum class PitchRangePreset
+{
+    Full,   // 50 - 5000 Hz
+    Bass,   // 30 - 400 Hz
+    Vocal,  // 70 - 1100 Hz
+    Lead    // 150 - 2500 Hz
+};
+
+struct PitchAnalysisConfig
+{
+    int windowSize = 2048;       // Samples per analysis frame (power of two)
+    int hopSize = 512;           // Samples between consecutive frame starts (4x overlap)
+    int trackingHopSize = 0;     // Hop of the live tracker while recording; 0 picks one for the engine
+    float minFrequency = 50.0f;  // Lowest pitch searched, in Hz
+    float maxFrequency = 5000.0f; // Highest pitch searched, in Hz
+    float threshold = 0.1f;      // YIN absolute threshold on the CMNDF
+    int decimationFactor = 0;    // 1, 2, 4 or 8; 0 picks one from the sample rate and frequency range
+    float silenceThreshold = 0.001f;   // Frames below this RMS (-60 dBFS) are skipped as silence
+    float maxZeroCrossingRate = 0.45f; // Frames crossing zero more often per sample are skipped as noise
+    PitchEngineType engine = PitchEngineType::YIN;
+
+    bool operator==(const PitchAnalysisConfig& other) const
+    {
+        return windowSize == other.windowSize && hopSize == other.hopSize && trackingHopSize == other.trackingHopSize
+            && minFrequency == other.minFrequency && maxFrequency == other.maxFrequency && threshold == other.threshold
+            && decimationFactor == other.decimationFactor && silenceThreshold == other.silenceThreshold
+            && maxZeroCrossingRate == other.maxZeroCrossingRate && engine == other.engine;
+    }
+
+    bool operator!=(const PitchAnalysisConfig& other) const { return ! (*this == other); }
+
+    /** Smallest power-of-two window whose half covers the longest lag of the range, with 4x overlap */
+    static PitchAnalysisConfig forFrequencyRange(double sampleRate, float minHz, float maxHz)
+    {
+        PitchAnalysisConfig config;
+        config.minFrequency = minHz;
+        config.maxFrequency = maxHz;
+
+        // The search reads one lag past the longest period
+        const int longestLag = (int) std::ceil(sampleRate / minHz) + 2;
+        config.windowSize = juce::nextPowerOfTwo(2 * longestLag);
+        config.hopSize = config.windowSize / 4;
+        return config;
+    }
+
+    static PitchAnalysisConfig forPreset(PitchRangePreset preset, double sampleRate)
+    {
+        switch (preset)
+        {
+        case PitchRangePreset::Bass:  return forFrequencyRange(sampleRate, 30.0f, 400.0f);
+        case PitchRangePreset::Vocal: return forFrequencyRange(sampleRate, 70.0f, 1100.0f);
+        case PitchRangePreset::Lead:  return forFrequencyRange(sampleRate, 150.0f, 2500.0f);
+        case PitchRangePreset::Full:  break;
+        }
+
+        return forFrequencyRange(sampleRate, 50.0f, 5000.0f);
+    }
+};
+
+//==============================================================================
+/**
+ * One cache-line aligned allocation that an engine carves all of its per-frame
+ * workspaces from, so consecutive frames of a batch reuse the same memory
+ */
+class ScratchArena
+{
+public:
+    static constexpr size_t alignment = 64;
+
+    /** Bytes take<T>(count) will use, including padding to the next aligned offset */
+    template <typename T>
+    static size_t bytesFor(size_t count)
+    {
+        return (count * sizeof(T) + alignment - 1) & ~(alignment - 1);
+    }
+
+    /** Replaces the arena with a zeroed one of at least numBytes; earlier pointers become invalid */
+    void allocate(size_t numBytes)
+    {
+        storage.reset(new char[numBytes + alignment]());
+
+        void* start = storage.get();
+        size_t space = numBytes + alignment;
+        base = static_cast<char*>(std::align(alignment, numBytes, start, space));
+        capacity = numBytes;
+        used = 0;
+    }
+
+    /** Hands out the next count elements; call in a fixed order from the owner's constructor */
+    template <typename T>
+    T* take(size_t count)
+    {
+        jassert(used + bytesFor<T>(count) <= capacity);
+
+        T* block = reinterpret_cast<T*>(base + used);
+        used += bytesFor<T>(count);
+        return block;
+    }
+
+private:
+    std::unique_ptr<char[]> storage;
+    char* base = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+};
+
+//==============================================================================
+/**
+ * Interface shared by the pitch engines. Holds the config, the lag range the
+ * frequency range maps to and the kernels; engines implement analysePitch().
+ */
+class PitchEngine
+{
+public:
+    PitchEngine(double sampleRate, const PitchAnalysisConfig& analysisConfig)
+        : sampleRate(sampleRate), config(analysisConfig)
+    {
+        jassert(juce::isPowerOfTwo(config.windowSize));
+
+        // Lags searched for an extremum; tau - 1 and tau + 1 must stay inside the half window
+        const int largestLag = config.windowSize / 2 - 2;
+        minLag = juce::jlimit(2, juce::jmax(2, largestLag), (int) std::floor(sampleRate / config.maxFrequency));
+        maxLag = juce::jlimit(minLag, juce::jmax(minLag, largestLag), (int) std::ceil(sampleRate / config.minFrequency));
+    }
+
+    virtual ~PitchEngine() = default;
+
+    /** Creates the engine selected by config.engine */
+    static std::unique_ptr<PitchEngine> create(double sampleRate, const PitchAnalysisConfig& config);
+
+    virtual const char* getName() const = 0;
+
+    /** Analyses the first getWindowSize() samples of buffer; returns no pitch if size is smaller */
+    virtual PitchEstimate analysePitch(const float* buffer, int size) = 0;
+
+    /**
+     * Batched analysis of every full window of buffer[0, numSamples) at hopSize,
+     * written to track from firstTrackFrame on (the track must be large enough).
+     * All frames share this engine's FFT plan and scratch arena. Returns the frame count.
+     */
+    int analyseTrack(const float* buffer, int numSamples, int hopSize, PitchTrack& track, int firstTrackFrame = 0)
+    {
+        const int numFrames = PitchTrack::countFrames(numSamples, config.windowSize, hopSize);
+        jassert(firstTrackFrame + numFrames <= track.size());
+
+        for (int frame = 0; frame < numFrames; ++frame)
+            track.set(firstTrackFrame + frame, analysePitch(buffer + (size_t) frame * hopSize, config.windowSize));
+
+        return numFrames;
+    }
+
+    float detectPitch(const float* buffer, int size)
+    {
+        return analysePitch(buffer, size).frequency;
+    }
+
+    const PitchAnalysisConfig& getConfig() const { return config; }
+    int getWindowSize() const { return config.windowSize; }
+
+    /**
+     * The energy / zero-crossing gate from a full-rate window's sums and
+     * zero-crossing count, for callers that keep them running or gate a frame
+     * before it reaches an engine
+     */
+    static bool passesEnergyGate(const PitchAnalysisConfig& config, double sum, double sumOfSquares, int zeroCrossings, float& rms)
+    {
+        const int windowSize = config.windowSize;
+
+        const double mean = sum / windowSize;
+        rms = (float) std::sqrt(juce::jmax(0.0, sumOfSquares / windowSize - mean * mean));
+
+        if (rms < config.silenceThreshold)
+            return false;
+
+        return zeroCrossings <= config.maxZeroCrossingRate * (windowSize - 1);
+    }
+
+    /** Overrides the runtime-selected SIMD kernels, e.g. with YinKernels::getScalarKernels() for verification */
+    void setKernels(const YinKernels::KernelTable& newKernels) { kernels = &newKernels; }
+    const YinKernels::KernelTable& getKernels() const { return *kernels; }
+
+    juce::String noteFromFrequency(float frequency)
+    {
+        if (frequency <= 0.0f)
+            return "No pitch detected";
+
+        static const char* noteNames[] = { "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B" };
+
+        int roundedMidiNote = midiNoteFromFrequency(frequency);
+
+        // Calculate octave and note
+        int octave = (roundedMidiNote / 12) - 1;
+        int noteIndex = roundedMidiNote % 12;
+
+        return juce::String(noteNames[noteIndex]) + juce::String(octave);
+    }
+
+    /** Nearest MIDI note, -1 if there is no pitch */
+    static int midiNoteFromFrequency(float frequency)
+    {
+        if (frequency <= 0.0f)
+            return -1;
+
+        return juce::roundToInt(PitchConversion::midiNoteFromFrequency(frequency));
+    }
+
+protected:
+    /** One vectorised pass over the window: RMS about the mean and zero-crossing rate */
+    bool passesEnergyGate(const float* buffer, float& rms) const
+    {
+        const auto stats = kernels->frameStatistics(buffer, config.windowSize);
+        return passesEnergyGate(config, stats.sum, stats.sumOfSquares, stats.zeroCrossings, rms);
+    }
+
+    /** YIN's absolute threshold search over a normalised difference function, with parabolic refinement */
+    PitchEstimate findFirstMinimum(const float* yinBuffer, PitchEstimate estimate) const
+    {
+        return findFirstMinimum(yinBuffer, estimate, minLag, maxLag);
+    }
+
+    /** The same search restricted to lags [firstTau, lastTau]; yinBuffer must cover firstTau - 1 to lastTau + 1 */
+    PitchEstimate findFirstMinimum(const float* yinBuffer, PitchEstimate estimate, int firstTau, int lastTau) const
+    {
+        int tau = firstTau;
+        const float threshold = config.threshold;
+
+        while (tau <= lastTau)
+        {
+            if (yinBuffer[tau] < threshold &&
+                yinBuffer[tau] < yinBuffer[tau - 1] &&
+                yinBuffer[tau] < yinBuffer[tau + 1])
+            {
+                // Refine the estimate with parabolic interpolation
+                float alpha = yinBuffer[tau - 1];
+                float beta = yinBuffer[tau];
+                float gamma = yinBuffer[tau + 1];
+                float p = 0.5f * (alpha - gamma) / (alpha - 2.0f * beta + gamma);
+
+                // Return the frequency
+                estimate.frequency = static_cast<float>(sampleRate / (tau + p));
+                estimate.confidence = 1.0f - beta;
+                estimate.voiced = true;
+                return estimate;
+            }
+            tau++;
+        }
+
+        // If no pitch found
+        return estimate;
+    }
+
+    double sampleRate;
+    PitchAnalysisConfig config;
+    int minLag = 2, maxLag = 2;
+    const YinKernels::KernelTable* kernels = &YinKernels::getBestKernels();
+    ScratchArena scratch;
+};
+
+//==============================================================================
+/**
+ * FFT cross-correlation of the first half of a window with the whole window,
+ * r(tau) = sum over j < W/2 of x_j * x_{j+tau}, plus O(1) window energies.
+ * Both engines are built on it: YIN's d(tau) and McLeod's m(tau) are the
+ * energies of the two W/2-sample windows combined with r(tau).
+ */
+class HalfWindowCorrelator
+{
+public:
+    explicit HalfWindowCorrelator(int windowSize)
+        : halfSize(windowSize / 2), fftPlan(juce::nextPowerOfTwo(juce::jmax(4, windowSize)))
+    {
+    }
+
+    /** Arena space needed by attach() */
+    static size_t scratchBytes(int windowSize)
+    {
+        return ScratchArena::bytesFor<std::complex<double>>((size_t) juce::nextPowerOfTwo(juce::jmax(4, windowSize)))
+             + ScratchArena::bytesFor<double>((size_t) windowSize + 1);
+    }
+
+    /** Takes the workspaces from the owning engine's arena */
+    void attach(ScratchArena& arena)
+    {
+        fftBuffer = arena.take<std::complex<double>>((size_t) fftPlan.getSize());
+        energyPrefix = arena.take<double>((size_t) (2 * halfSize + 1));
+    }
+
+    /** Computes r(tau) for tau < endLag, which must not exceed W/2 */
+    void compute(const float* buffer, int endLag)
+    {
+        if (halfSize == 0)
+            return;
+
+        correlate(buffer, halfSize, fftBuffer, fftPlan.getSize(),
+                  [this](std::complex<double>* data, bool inverse) { fftPlan.perform(data, inverse); });
+
+        // Prefix sums of squares give every window energy in O(1)
+        energyPrefix[0] = 0.0;
+        for (int i = 0; i < juce::jmin(2 * halfSize - 1, halfSize + endLag); ++i)
+            energyPrefix[i + 1] = energyPrefix[i] + (double) buffer[i] * buffer[i];
+    }
+
+    /**
+     * The correlation itself, for any transform of fftSize >= 2 * halfSize: leaves
+     * r(tau) in the real parts of fftBuffer. Shared with the fixed-size detectors.
+     */
+    template <typename Transform>
+    static void correlate(const float* buffer, int halfSize, std::complex<double>* fftBuffer, int fftSize, Transform&& transform)
+    {
+        const int inputSize = 2 * halfSize - 1;
+
+        // Pack the first half (real) and the whole window (imaginary) into one transform
+        for (int i = 0; i < fftSize; ++i)
+        {
+            const double head = i < halfSize ? buffer[i] : 0.0;
+            const double full = i < inputSize ? buffer[i] : 0.0;
+            fftBuffer[i] = { head, full };
+        }
+
+        transform(fftBuffer, false);
+
+        // Unpack both spectra and form conj(Head) * Full
+        for (int k = 0; k <= fftSize / 2; ++k)
+        {
+            const auto z = fftBuffer[k];
+            const auto zMirror = std::conj(fftBuffer[(fftSize - k) & (fftSize - 1)]);
+
+            const auto head = 0.5 * (z + zMirror);
+            const auto full = std::complex<double>(0.0, -0.5) * (z - zMirror);
+
+            const auto product = std::conj(head) * full;
+            fftBuffer[k] = product;
+
+            if (k > 0 && k < fftSize / 2)
+                fftBuffer[fftSize - k] = std::conj(product);
+        }
+
+        transform(fftBuffer, true);
+    }
+
+    double getCorrelation(int tau) const { return fftBuffer[tau].real(); }
+
+    /** Energy of the W/2 samples starting at tau */
+    double getEnergy(int tau) const { return energyPrefix[tau + halfSize] - energyPrefix[tau]; }
+
+private:
+    int halfSize;
+    FFTPlan fftPlan;
+    std::complex<double>* fftBuffer = nullptr;
+    double* energyPrefix = nullptr;
+};
+
+//==============================================================================
+/**
+ * Pitch detector class using YIN algorithm
+ */
+class PitchDetector : public PitchEngine
+{
+public:
+    /** How the YIN difference function is computed */
+    enum class DifferenceMethod
+    {
+        BruteForce, // Direct O(W^2) evaluation, kept as a reference
+        FFT         // Autocorrelation via FFT plus prefix sums of squares, O(W log W)
+    };
+
+    /** All workspaces are allocated here from the config; analysis never allocates */
+    PitchDetector(double sampleRate, const PitchAnalysisConfig& analysisConfig)
+        : PitchEngine(sampleRate, analysisConfig), correlator(analysisConfig.windowSize)
+    {
+        const int windowSize = config.windowSize;
+        halfSize = windowSize / 2;
+
+        scratch.allocate(ScratchArena::bytesFor<float>((size_t) halfSize)
+                         + 2 * ScratchArena::bytesFor<double>((size_t) windowSize + 1)
+                         + HalfWindowCorrelator::scratchBytes(windowSize));
+
+        yinBuffer = scratch.take<float>((size_t) halfSize);
+        energyPrefix = scratch.take<double>((size_t) windowSize + 1);
+        samplePrefix = scratch.take<double>((size_t) windowSize + 1);
+        correlator.attach(scratch);
+    }
+
+    const char* getName() const override { return "YIN"; }
+
+    void setDifferenceMethod(DifferenceMethod newMethod) { differenceMethod = newMethod; }
+    DifferenceMethod getDifferenceMethod() const { return differenceMethod; }
+
+    PitchEstimate analysePitch(const float* buffer, int size) override
+    {
+        if (size < config.windowSize || halfSize < 4)
+            return {};
+
+        // Step 0: Skip silent and noise-like frames before the expensive difference function
+        PitchEstimate estimate;
+        if (! passesEnergyGate(buffer, estimate.rms))
+            return estimate;
+
+        // YIN algorithm for pitch detection, evaluated only up to the lags the search can reach
+        const int endLag = maxLag + 2;
+
+        // Step 1: Calculate difference function
+        // Step 2: Cumulative mean normalized difference function
+        if (differenceMethod == DifferenceMethod::FFT)
+        {
+            computeDifferenceFFT(buffer, endLag);
+            yinBuffer[0] = 1.0f;
+            kernels->cumulativeMeanNormalise(yinBuffer, 1, endLag, 0.0f);
+        }
+        else
+        {
+            // Lags below minLag - 1 only contribute to the running sum, which has a closed form
+            const int firstLag = minLag - 1;
+            computeDifferenceBruteForce(buffer, firstLag, endLag);
+            kernels->cumulativeMeanNormalise(yinBuffer, firstLag, endLag, (float) sumOfDifferences(buffer, firstLag - 1));
+        }
+
+        // Step 3: Find the first minimum below threshold within the configured range
+        return findFirstMinimum(yinBuffer, estimate);
+    }
+
+    /**
+     * YIN restricted to the lags [firstLag, endLag) around a candidate period from
+     * a coarse estimator. Only that band of the difference function is evaluated;
+     * the CMNDF's running sum over all smaller lags comes from the O(W) closed form,
+     * so the result and its parabolic refinement match a full search that finds its
+     * first dip inside the band. Reads W/2 + endLag + 1 samples and does not gate;
+     * the caller has already done that for this frame.
+     */
+    PitchEstimate analyseLagBand(const float* buffer, int firstLag, int endLag, PitchEstimate estimate = {})
+    {
+        firstLag = juce::jlimit(juce::jmax(2, minLag), maxLag, firstLag);
+        endLag = juce::jlimit(firstLag + 1, maxLag + 1, endLag);
+
+        // Step 1: Difference function over the band plus one neighbour on each side
+        computeDifferenceBruteForce(buffer, firstLag - 1, endLag + 1);
+
+        // Step 2: Cumulative mean normalisation, seeded with d(1) + ... + d(firstLag - 2)
+        kernels->cumulativeMeanNormalise(yinBuffer, firstLag - 1, endLag + 1, (float) sumOfDifferences(buffer, firstLag - 2));
+
+        // Step 3: First minimum below threshold within the band
+        return findFirstMinimum(yinBuffer, estimate, firstLag, endLag - 1);
+    }
+
+protected:
+    // Workspaces in the scratch arena
+    int halfSize = 0;
+    float* yinBuffer = nullptr;
+    double* energyPrefix = nullptr;
+    double* samplePrefix = nullptr;
+
+private:
+    void computeDifferenceBruteForce(const float* buffer, int firstLag, int endLag)
+    {
+        kernels->difference(buffer, yinBuffer, firstLag, endLag, halfSize);
+    }
+
+    /**
+     * Sum of d(1) .. d(numLags) in O(W) rather than O(numLags * W):
+     * numLags * r_0(0) + sum of r_k(0) - 2 * sum over j of x_j * (x_{j+1} + ... + x_{j+numLags})
+     */
+    double sumOfDifferences(const float* buffer, int numLags)
+    {
+        if (numLags <= 0)
+            return 0.0;
+
+        const int inputSize = halfSize + numLags;
+
+        energyPrefix[0] = 0.0;
+        samplePrefix[0] = 0.0;
+        for (int i = 0; i < inputSize; ++i)
+        {
+            energyPrefix[i + 1] = energyPrefix[i] + (double) buffer[i] * buffer[i];
+            samplePrefix[i + 1] = samplePrefix[i] + buffer[i];
+        }
+
+        double shiftedEnergies = 0.0;
+        for (int k = 1; k <= numLags; ++k)
+            shiftedEnergies += energyPrefix[k + halfSize] - energyPrefix[k];
+
+        double correlations = 0.0;
+        for (int j = 0; j < halfSize; ++j)
+            correlations += buffer[j] * (samplePrefix[j + numLags + 1] - samplePrefix[j + 1]);
+
+        return juce::jmax(0.0, numLags * energyPrefix[halfSize] + shiftedEnergies - 2.0 * correlations);
+    }
+
+    void computeDifferenceFFT(const float* buffer, int endLag)
+    {
+        // d(tau) = r_0(0) + r_tau(0) - 2 r(tau), where r(tau) is the cross-correlation
+        // of the first W samples with the whole window and r_tau(0) is the energy of
+        // the W samples starting at tau.
+        correlator.compute(buffer, endLag);
+
+        const double headEnergy = correlator.getEnergy(0);
+
+        for (int tau = 0; tau < endLag; ++tau)
+        {
+            const double difference = headEnergy + correlator.getEnergy(tau) - 2.0 * correlator.getCorrelation(tau);
+            yinBuffer[tau] = (float) juce::jmax(0.0, difference);
+        }
+    }
+
+    DifferenceMethod differenceMethod = DifferenceMethod::FFT;
+    HalfWindowCorrelator correlator;
+};
+
+//==============================================================================
+/**
+ * McLeod Pitch Method: the normalised square difference function
+ * n(tau) = 2 r(tau) / m(tau), with m(tau) the summed energy of the two windows,
+ * evaluated with the same FFT correlation as YIN. The pitch is the first key
+ * maximum (the peak of a positive lobe) within (1 - threshold) of the highest.
+ */
+class McLeodPitchDetector : public PitchEngine
+{
+public:
+    McLeodPitchDetector(double sampleRate, const PitchAnalysisConfig& analysisConfig)
+        : PitchEngine(sampleRate, analysisConfig), correlator(analysisConfig.windowSize)
+    {
+        halfSize = config.windowSize / 2;
+
+        scratch.allocate(ScratchArena::bytesFor<float>((size_t) halfSize) + HalfWindowCorrelator::scratchBytes(config.windowSize));
+
+        nsdfBuffer = scratch.take<float>((size_t) halfSize);
+        correlator.attach(scratch);
+    }
+
+    const char* getName() const override { return "McLeod"; }
+
+    PitchEstimate analysePitch(const float* buffer, int size) override
+    {
+        if (size < config.windowSize || halfSize < 4)
+            return {};
+
+        // Step 0: Skip silent and noise-like frames before the correlation
+        PitchEstimate estimate;
+        if (! passesEnergyGate(buffer, estimate.rms))
+            return estimate;
+
+        const int endLag = maxLag + 2;
+
+        // Step 1: Normalised square difference function
+        correlator.compute(buffer, endLag);
+
+        const double headEnergy = correlator.getEnergy(0);
+
+        for (int tau = 0; tau < endLag; ++tau)
+        {
+            const double energies = headEnergy + correlator.getEnergy(tau);
+            nsdfBuffer[tau] = energies > 0.0 ? (float) (2.0 * correlator.getCorrelation(tau) / energies) : 0.0f;
+        }
+
+        // Step 2: Key maxima, one per positive lobe after the lobe around tau = 0
+        int tau = 1;
+        while (tau < endLag - 1 && nsdfBuffer[tau] > 0.0f)
+            ++tau;
+
+        int numPeaks = 0;
+        float highest = 0.0f;
+        int peak = -1;
+
+        for (; tau < endLag - 1; ++tau)
+        {
+            if (nsdfBuffer[tau] > 0.0f)
+            {
+                if (peak < 0 || nsdfBuffer[tau] > nsdfBuffer[peak])
+                    peak = tau;
+            }
+            else if (peak >= 0)
+            {
+                addKeyMaximum(peak, numPeaks, highest);
+                peak = -1;
+            }
+        }
+
+        if (peak >= 0)
+            addKeyMaximum(peak, numPeaks, highest);
+
+        // Step 3: First key maximum close enough to the highest one
+        const float cutoff = (1.0f - config.threshold) * highest;
+
+        for (int i = 0; i < numPeaks; ++i)
+        {
+            const int lag = keyMaxima[(size_t) i];
+            if (nsdfBuffer[lag] < cutoff)
+                continue;
+
+            // Refine the estimate with parabolic interpolation
+            const float alpha = nsdfBuffer[lag - 1];
+            const float beta = nsdfBuffer[lag];
+            const float gamma = nsdfBuffer[lag + 1];
+            const float denominator = alpha - 2.0f * beta + gamma;
+            const float p = denominator < 0.0f ? 0.5f * (alpha - gamma) / denominator : 0.0f;
+
+            const float clarity = beta - 0.25f * (alpha - gamma) * p;
+            if (clarity < minimumClarity)
+                break;
+
+            estimate.frequency = static_cast<float>(sampleRate / (lag + p));
+            estimate.confidence = juce::jmin(1.0f, clarity);
+            estimate.voiced = true;
+            break;
+        }
+
+        return estimate;
+    }
+
+private:
+    /** Lobes peaking outside the configured range are ignored */
+    void addKeyMaximum(int lag, int& numPeaks, float& highest)
+    {
+        if (lag < minLag || lag > maxLag || numPeaks >= maxKeyMaxima)
+            return;
+
+        keyMaxima[(size_t) numPeaks++] = lag;
+        highest = juce::jmax(highest, nsdfBuffer[lag]);
+    }
+
+    static constexpr int maxKeyMaxima = 64;
+    static constexpr float minimumClarity = 0.5f;
+
+    int halfSize = 0;
+    float* nsdfBuffer = nullptr; // In the scratch arena
+    std::array<int, maxKeyMaxima> keyMaxima {};
+    HalfWindowCorrelator correlator;
+};
+
+//==============================================================================
+/**
+ * YIN specialised for a window size fixed at compile time. Workspaces are
+ * aligned std::arrays inside the object and the FFT is a FixedSizeFFT, so the
+ * correlation runs with constant trip counts and no per-call indirection.
+ * PitchEngine::create() picks an instantiation when the window size matches.
+ */
+template <int WindowSize>
+class FixedSizePitchDetector : public PitchEngine
+{
+public:
+    static_assert(WindowSize >= 8 && (WindowSize & (WindowSize - 1)) == 0, "window size must be a power of two");
+
+    FixedSizePitchDetector(double sampleRate, const PitchAnalysisConfig& analysisConfig)
+        : PitchEngine(sampleRate, analysisConfig)
+    {
+        jassert(config.windowSize == WindowSize);
+        FixedSizeFFT<WindowSize>::prepare();
+    }
+
+    const char* getName() const override { return "YIN"; }
+
+    PitchEstimate analysePitch(const float* buffer, int size) override
+    {
+        if (size < WindowSize)
+            return {};
+
+        // Step 0: Skip silent and noise-like frames before the expensive difference function
+        PitchEstimate estimate;
+        if (! passesEnergyGate(buffer, estimate.rms))
+            return estimate;
+
+        const int endLag = maxLag + 2;
+
+        // Step 1: Difference function from the FFT correlation and window energies
+        HalfWindowCorrelator::correlate(buffer, halfSize, fftBuffer.data(), WindowSize, FixedSizeFFT<WindowSize>::perform);
+
+        energyPrefix[0] = 0.0;
+        for (int i = 0; i < halfSize + endLag - 1; ++i)
+            energyPrefix[(size_t) i + 1] = energyPrefix[(size_t) i] + (double) buffer[i] * buffer[i];
+
+        const double headEnergy = energyPrefix[halfSize];
+
+        for (int tau = 0; tau < endLag; ++tau)
+        {
+            const double shiftedEnergy = energyPrefix[(size_t) (tau + halfSize)] - energyPrefix[(size_t) tau];
+            const double difference = headEnergy + shiftedEnergy - 2.0 * fftBuffer[(size_t) tau].real();
+            yinBuffer[(size_t) tau] = (float) juce::jmax(0.0, difference);
+        }
+
+        // Step 2: Cumulative mean normalized difference function
+        yinBuffer[0] = 1.0f;
+        kernels->cumulativeMeanNormalise(yinBuffer.data(), 1, endLag, 0.0f);
+
+        // Step 3: Find the first minimum below threshold within the configured range
+        return findFirstMinimum(yinBuffer.data(), estimate);
+    }
+
+private:
+    static constexpr int halfSize = WindowSize / 2;
+
+    alignas(64) std::array<float, halfSize> yinBuffer {};
+    alignas(64) std::array<std::complex<double>, WindowSize> fftBuffer {};
+    alignas(64) std::array<double, WindowSize + 1> energyPrefix {};
+};
+
+inline std::unique_ptr<PitchEngine> PitchEngine::create(double sampleRate, const PitchAnalysisConfig& config)
+{
+    switch (config.engine)
+    {
+    case PitchEngineType::McLeod: return std::make_unique<McLeodPitchDetector>(sampleRate, config);
+    case PitchEngineType::YIN:    break;
+    }
+
+    // Common window sizes get a compile-time specialised YIN
+    switch (config.windowSize)
+    {
+    case 512:  return std::make_unique<FixedSizePitchDetector<512>>(sampleRate, config);
+    case 1024: return std::make_unique<FixedSizePitchDetector<1024>>(sampleRate, config);
+    case 2048: return std::make_unique<FixedSizePitchDetector<2048>>(sampleRate, config);
+    case 4096: return std::make_unique<FixedSizePitchDetector<4096>>(sampleRate, config);
+    default:   break;
+    }
+
+    return std::make_unique<PitchDetector>(sampleRate, config);
+}
+
+//==============================================================================
+/**
+ * Streaming YIN for hop-by-hop tracking. Instead of recomputing d(tau) for every
+ * window, per-lag accumulators are updated as one hop of samples enters the
+ * integration window and one hop leaves it, so a hop costs O(lags * hop) rather
+ * than O(lags * window). The energy gate's sums and zero-crossing count slide
+ * the same way. Every few windows the lags are recomputed from scratch, a slice
+ * per hop over one window's hops into a second set of accumulators that then
+ * replaces the first, which keeps rounding drift bounded without a costly hop.
+ */
+class SlidingYinDetector : public PitchDetector
+{
+public:
+    /** hopSize must divide the window and be at most half of it */
+    SlidingYinDetector(double sampleRate, const PitchAnalysisConfig& analysisConfig, int hopSize)
+        : PitchDetector(sampleRate, analysisConfig), hop(hopSize)
+    {
+        jassert(hop > 0 && hop <= halfSize && config.windowSize % hop == 0);
+
+        endLag = maxLag + 2;
+        history.assign((size_t) (config.windowSize + hop), 0.0f);
+        accumulators.assign((size_t) endLag, 0.0);
+        resynced.assign((size_t) endLag, 0.0);
+        entering.assign((size_t) endLag, 0.0f);
+        leaving.assign((size_t) endLag, 0.0f);
+
+        const int hopsPerWindow = config.windowSize / hop;
+        hopsPerResync = resyncWindows * hopsPerWindow;
+        lagsPerResyncHop = (endLag - 1 + hopsPerWindow - 1) / hopsPerWindow;
+    }
+
+    int getHopSize() const { return hop; }
+
+    void reset()
+    {
+        std::fill(history.begin(), history.end(), 0.0f);
+        samplesReceived = 0;
+        hopsSinceResync = 0;
+        nextResyncLag = 0;
+    }
+
+    /** True once a full window has been received */
+    bool isPrimed() const { return samplesReceived >= config.windowSize; }
+
+    /**
+     * Appends exactly getHopSize() samples and returns the estimate for the latest
+     * window (nothing until the window has filled). Never allocates.
+     */
+    PitchEstimate pushHop(const float* samples)
+    {
+        const int windowSize = config.windowSize;
+
+        // Step 1: Slide the history by one hop; the old window starts at history[0]
+        std::copy(history.begin() + hop, history.end(), history.begin());
+        std::copy(samples, samples + hop, history.end() - hop);
+        samplesReceived += hop;
+
+        if (! isPrimed())
+            return {};
+
+        const float* window = history.data() + hop;
+
+        // Step 2: Update d(tau) and the gate's sums for the hop entering and the hop leaving the window
+        if (samplesReceived == windowSize)
+        {
+            kernels->difference(window, entering.data(), 1, endLag, halfSize);
+            for (int tau = 1; tau < endLag; ++tau)
+                accumulators[(size_t) tau] = entering[(size_t) tau];
+
+            resyncGateSums(window);
+            hopsSinceResync = 0;
+            nextResyncLag = 0;
+        }
+        else
+        {
+            kernels->difference(history.data(), leaving.data(), 1, endLag, hop);
+            kernels->difference(window + halfSize - hop, entering.data(), 1, endLag, hop);
+
+            // Lags a running resync has already recomputed slide along with the accumulators
+            for (int tau = 1; tau < endLag; ++tau)
+            {
+                const double change = (double) entering[(size_t) tau] - (double) leaving[(size_t) tau];
+                accumulators[(size_t) tau] += change;
+
+                if (tau < nextResyncLag)
+                    resynced[(size_t) tau] += change;
+            }
+
+            // Each side takes one extra sample for the crossing over its boundary, whose own sums don't move
+            const float* enteringSamples = history.data() + windowSize - 1;
+            const auto left = kernels->frameStatistics(history.data(), hop + 1);
+            const auto entered = kernels->frameStatistics(enteringSamples, hop + 1);
+
+            windowSum += ((double) entered.sum - enteringSamples[0]) - ((double) left.sum - history[(size_t) hop]);
+            windowSumOfSquares += ((double) entered.sumOfSquares - (double) enteringSamples[0] * enteringSamples[0])
+                                - ((double) left.sumOfSquares - (double) history[(size_t) hop] * history[(size_t) hop]);
+            windowCrossings += entered.zeroCrossings - left.zeroCrossings;
+
+            // Step 3: Recompute the next slice of lags; the last one swaps the fresh sums in
+            if (nextResyncLag == 0 && ++hopsSinceResync >= hopsPerResync)
+            {
+                nextResyncLag = 1;
+                hopsSinceResync = 0;
+            }
+
+            if (nextResyncLag > 0)
+            {
+                const int sliceEnd = juce::jmin(endLag, nextResyncLag + lagsPerResyncHop);
+                kernels->difference(window, entering.data(), nextResyncLag, sliceEnd, halfSize);
+
+                for (int tau = nextResyncLag; tau < sliceEnd; ++tau)
+                    resynced[(size_t) tau] = entering[(size_t) tau];
+
+                nextResyncLag = sliceEnd;
+
+                if (nextResyncLag == endLag)
+                {
+                    std::swap(accumulators, resynced);
+                    resyncGateSums(window);
+                    nextResyncLag = 0;
+                }
+            }
+        }
+
+        // Step 4: Gate, normalise and search as in PitchDetector
+        PitchEstimate estimate;
+        if (! passesEnergyGate(config, windowSum, windowSumOfSquares, windowCrossings, estimate.rms))
+            return estimate;
+
+        yinBuffer[0] = 1.0f;
+        for (int tau = 1; tau < endLag; ++tau)
+            yinBuffer[tau] = (float) juce::jmax(0.0, accumulators[(size_t) tau]);
+
+        kernels->cumulativeMeanNormalise(yinBuffer, 1, endLag, 0.0f);
+        return findFirstMinimum(yinBuffer, estimate);
+    }
+
+private:
+    static constexpr int resyncWindows = 8;
+
+    /** The gate's sums over the whole window, from scratch */
+    void resyncGateSums(const float* window)
+    {
+        const auto stats = kernels->frameStatistics(window, config.windowSize);
+        windowSum = stats.sum;
+        windowSumOfSquares = stats.sumOfSquares;
+        windowCrossings = stats.zeroCrossings;
+    }
+
+    int hop;
+    int endLag = 0;
+    int hopsPerResync = 1;
+    int hopsSinceResync = 0;
+    int lagsPerResyncHop = 1;
+    int nextResyncLag = 0; // First lag the running resync has still to recompute, 0 between resyncs
+    juce::int64 samplesReceived = 0;
+
+    std::vector<float> history; // The previous window's first hop followed by the current window
+    std::vector<double> accumulators, resynced;
+    std::vector<float> entering, leaving;
+    double windowSum = 0.0, windowSumOfSquares = 0.0;
+    int windowCrossings = 0;
+};
+
+//==============================================================================
+/**
+ * Analysis front-end: downmixes a stereo frame, low-passes and decimates it by
+ * 1, 2, 4 or 8 with a polyphase FIR (only the kept outputs are computed), and
+ * removes the frame's DC offset. Downmix and filter run as one vectorised pass.
+ */
+class AnalysisFrontEnd
+{
+public:
+    explicit AnalysisFrontEnd(int decimationFactor)
+        : factor(decimationFactor)
+    {
+        jassert(factor == 1 || factor == 2 || factor == 4 || factor == 8);
+
+        // Windowed-sinc low-pass at 90% of the decimated Nyquist, with the 0.5 downmix gain folded in
+        const int numTaps = factor == 1 ? 1 : 16 * factor;
+        taps.resize(numTaps);
+
+        if (factor == 1)
+        {
+            taps[0] = 0.5f;
+        }
+        else
+        {
+            const double cutoff = 0.9 * 0.5 / factor;
+            const double centre = 0.5 * (numTaps - 1);
+            double sum = 0.0;
+            std::vector<double> design(numTaps);
+
+            for (int i = 0; i < numTaps; ++i)
+            {
+                const double x = i - centre;
+                const double sinc = 2.0 * cutoff * (x == 0.0 ? 1.0 : std::sin(2.0 * juce::MathConstants<double>::pi * cutoff * x)
+                                                                         / (2.0 * juce::MathConstants<double>::pi * cutoff * x));
+                const double phase = 2.0 * juce::MathConstants<double>::pi * i / (numTaps - 1);
+                const double blackman = 0.42 - 0.5 * std::cos(phase) + 0.08 * std::cos(2.0 * phase);
+
+                design[i] = sinc * blackman;
+                sum += design[i];
+            }
+
+            for (int i = 0; i < numTaps; ++i)
+                taps[i] = (float) (0.5 * design[i] / sum);
+        }
+    }
+
+    int getFactor() const { return factor; }
+
+    /**
+     * Writes numSamples / factor decimated samples to output. right may be nullptr for mono.
+     * Taps that would reach outside the frame are dropped, as if the frame were zero-padded.
+     * Batched callers decimating a span of several frames remove DC per frame themselves.
+     */
+    void process(const float* left, const float* right, int numSamples, float* output, bool removeDcOffset = true) const
+    {
+        if (right == nullptr)
+            right = left;
+
+        const int numTaps = (int) taps.size();
+        const int delay = (numTaps - 1) / 2;
+        const int numOutputs = numSamples / factor;
+        double sum = 0.0;
+
+        for (int m = 0; m < numOutputs; ++m)
+        {
+            const int first = m * factor - delay;
+
+            float value;
+            if (first >= 0 && first + numTaps <= numSamples)
+            {
+                value = kernels->downmixDot(left + first, right + first, taps.data(), numTaps);
+            }
+            else
+            {
+                const int begin = juce::jmax(0, -first);
+                const int end = juce::jmin(numTaps, numSamples - first);
+                value = YinKernels::downmixDotScalar(left + first + begin, right + first + begin, taps.data() + begin, end - begin);
+            }
+
+            output[m] = value;
+            sum += value;
+        }
+
+        if (! removeDcOffset)
+            return;
+
+        // DC removal on the (much shorter) decimated frame
+        const float mean = numOutputs > 0 ? (float) (sum / numOutputs) : 0.0f;
+        for (int m = 0; m < numOutputs; ++m)
+            output[m] -= mean;
+    }
+
+    /**
+     * Largest factor that still leaves the shortest period at least 4 decimated
+     * samples long; DecimatingPitchDetector's full-rate bands catch the octave
+     * slips the coarse pass makes at such short lags.
+     */
+    static int chooseFactor(double sampleRate, const PitchAnalysisConfig& config)
+    {
+        if (config.decimationFactor > 0)
+            return config.decimationFactor;
+
+        for (int candidate = 8; candidate > 1; candidate /= 2)
+            if (sampleRate / candidate >= 4.0 * config.maxFrequency && config.windowSize / candidate >= 256)
+                return candidate;
+
+        return 1;
+    }
+
+private:
+    int factor;
+    std::vector<float> taps;
+    const YinKernels::KernelTable* kernels = &YinKernels::getBestKernels();
+};
+
+//==============================================================================
+/**
+ * The configured PitchEngine run on the decimated output of an AnalysisFrontEnd,
+ * refined at the full rate. The coarse period found at fs / factor only picks the
+ * candidate lags: full-rate YIN then evaluates O(factor) lags around it (and around
+ * its half and third, which catch the coarse pass locking an octave or a twelfth
+ * low) instead of all W/2, keeping YIN's threshold and parabolic refinement while
+ * the O(W log W) work runs on a window factor times shorter.
+ */
+class DecimatingPitchDetector
+{
+public:
+    DecimatingPitchDetector(double sampleRate, const PitchAnalysisConfig& analysisConfig)
+        : sampleRate(sampleRate), config(analysisConfig),
+          frontEnd(AnalysisFrontEnd::chooseFactor(sampleRate, analysisConfig))
+    {
+        const int factor = frontEnd.getFactor();
+
+        PitchAnalysisConfig coarseConfig = config;
+        coarseConfig.windowSize = config.windowSize / factor;
+        coarseConfig.hopSize = juce::jmax(1, config.hopSize / factor);
+
+        // Frames are gated at the full rate before the front-end, so the coarse engine lets everything through
+        coarseConfig.silenceThreshold = 0.0f;
+        coarseConfig.maxZeroCrossingRate = 1.0f;
+        coarse = PitchEngine::create(sampleRate / factor, coarseConfig);
+
+        decimated.resize(coarseConfig.windowSize);
+        decimatedSpan.resize(coarseConfig.windowSize + (maxFramesPerPass - 1) * coarseConfig.hopSize);
+        if (factor > 1)
+        {
+            fine = std::make_unique<PitchDetector>(sampleRate, config);
+            fine->setDifferenceMethod(PitchDetector::DifferenceMethod::BruteForce);
+        }
+
+        mono.resize(config.windowSize);
+    }
+
+    int getWindowSize() const { return config.windowSize; }
+    int getDecimationFactor() const { return frontEnd.getFactor(); }
+
+    /** Analyses the first getWindowSize() samples; right may be nullptr for mono input */
+    PitchEstimate analysePitch(const float* left, const float* right, int size)
+    {
+        if (size < config.windowSize)
+            return {};
+
+        // Step 1: Skip silent and noise-like frames before the front-end filters them
+        PitchEstimate estimate;
+        if (! passesFullRateGate(left, right, estimate.rms))
+            return estimate;
+
+        // Step 2: Stereo downmix, DC removal and decimation in one pass
+        frontEnd.process(left, right, config.windowSize, decimated.data());
+
+        return analyseDecimatedFrame(left, right, estimate.rms);
+    }
+
+    /**
+     * Batched analysis of every full window of [0, numSamples) at hopSize, written
+     * to track from firstTrackFrame on (the track must be large enough). Runs of up
+     * to maxFramesPerPass overlapping frames are decimated once as a single span, so
+     * a small hop no longer repeats the front-end work for every frame, and a run
+     * whose frames all fail the full-rate gate skips the front-end altogether.
+     * Returns the frame count.
+     */
+    int analyseTrack(const float* left, const float* right, int numSamples, int hopSize,
+                     PitchTrack& track, int firstTrackFrame = 0)
+    {
+        const int windowSize = config.windowSize;
+        const int factor = frontEnd.getFactor();
+        const int numFrames = PitchTrack::countFrames(numSamples, windowSize, hopSize);
+        jassert(firstTrackFrame + numFrames <= track.size());
+
+        // Frames that don't start on the decimated grid fall back to one pass per frame
+        if (factor == 1 || hopSize % factor != 0)
+        {
+            for (int frame = 0; frame < numFrames; ++frame)
+            {
+                const size_t offset = (size_t) frame * hopSize;
+                track.set(firstTrackFrame + frame, analysePitch(left + offset, right != nullptr ? right + offset : nullptr, windowSize));
+            }
+            return numFrames;
+        }
+
+        const int decimatedWindow = (int) decimated.size();
+        const int decimatedHop = hopSize / factor;
+        const int framesPerPass = juce::jlimit(1, maxFramesPerPass, ((int) decimatedSpan.size() - decimatedWindow) / decimatedHop + 1);
+
+        std::array<PitchEstimate, maxFramesPerPass> gated;
+        std::array<bool, maxFramesPerPass> passed;
+
+        for (int frame = 0; frame < numFrames; frame += framesPerPass)
+        {
+            const int passFrames = juce::jmin(framesPerPass, numFrames - frame);
+            const size_t offset = (size_t) frame * hopSize;
+            const float* passLeft = left + offset;
+            const float* passRight = right != nullptr ? right + offset : nullptr;
+
+            // Step 1: Gate every frame of the pass at the full rate
+            bool anyPassed = false;
+            for (int i = 0; i < passFrames; ++i)
+            {
+                const size_t frameOffset = (size_t) i * hopSize;
+                gated[(size_t) i] = {};
+                passed[(size_t) i] = passesFullRateGate(passLeft + frameOffset, passRight != nullptr ? passRight + frameOffset : nullptr,
+                                                        gated[(size_t) i].rms);
+                anyPassed = anyPassed || passed[(size_t) i];
+            }
+
+            // Step 2: Downmix and decimate the span covering this pass once, unless every frame was gated
+            if (anyPassed)
+                frontEnd.process(passLeft, passRight, windowSize + (passFrames - 1) * hopSize, decimatedSpan.data(), false);
+
+            for (int i = 0; i < passFrames; ++i)
+            {
+                if (! passed[(size_t) i])
+                {
+                    track.set(firstTrackFrame + frame + i, gated[(size_t) i]);
+                    continue;
+                }
+
+                // Step 3: Per-frame DC removal on the decimated samples
+                const float* source = decimatedSpan.data() + (size_t) i * decimatedHop;
+
+                double sum = 0.0;
+                for (int j = 0; j < decimatedWindow; ++j)
+                    sum += source[j];
+
+                const float mean = (float) (sum / decimatedWindow);
+                for (int j = 0; j < decimatedWindow; ++j)
+                    decimated[(size_t) j] = source[j] - mean;
+
+                // Step 4: Coarse analysis and full-rate refinement
+                const size_t frameOffset = (size_t) i * hopSize;
+                track.set(firstTrackFrame + frame + i,
+                          analyseDecimatedFrame(passLeft + frameOffset, passRight != nullptr ? passRight + frameOffset : nullptr,
+                                                gated[(size_t) i].rms));
+            }
+        }
+
+        return numFrames;
+    }
+
+private:
+    /**
+     * Energy / zero-crossing gate on the full-rate downmix, which its thresholds
+     * are calibrated for; costs one pass, against the front-end's FIR
+     */
+    bool passesFullRateGate(const float* left, const float* right, float& rms)
+    {
+        const int windowSize = config.windowSize;
+        const float* frame = left;
+
+        if (right != nullptr)
+        {
+            for (int i = 0; i < windowSize; ++i)
+                mono[i] = 0.5f * (left[i] + right[i]);
+
+            frame = mono.data();
+        }
+
+        const auto stats = kernels->frameStatistics(frame, windowSize);
+        return PitchEngine::passesEnergyGate(config, stats.sum, stats.sumOfSquares, stats.zeroCrossings, rms);
+    }
+
+    /** Runs the engine on the DC-free frame in decimated, refining at the full rate; rms is the full-rate gate's */
+    PitchEstimate analyseDecimatedFrame(const float* left, const float* right, float rms)
+    {
+        auto estimate = coarse->analysePitch(decimated.data(), (int) decimated.size());
+        estimate.rms = rms;
+
+        if (! estimate.voiced || frontEnd.getFactor() == 1)
+            return estimate;
+
+        return refine(left, right, sampleRate / estimate.frequency, estimate);
+    }
+
+    /**
+     * Full-rate YIN over bands of +-(factor + 1) lags around coarseLag / 3, / 2 and
+     * / 1, in that order, so the first band holding a dip below threshold wins just
+     * as it would in a full search. If none does, the coarse estimate stands.
+     */
+    PitchEstimate refine(const float* left, const float* right, double coarseLag, PitchEstimate estimate)
+    {
+        const int factor = frontEnd.getFactor();
+
+        // Whole 16-lag blocks (band plus its two neighbours), so the difference kernel stays on its vector path
+        const int bandLags = (2 * factor + 5 + 15) / 16 * 16 - 2;
+        const int lastEndLag = (int) std::floor(coarseLag) - factor - 1 + bandLags;
+
+        // Only the samples the bands read need the full-rate downmix
+        const int needed = juce::jmin(config.windowSize, config.windowSize / 2 + lastEndLag + 1);
+        for (int i = 0; i < needed; ++i)
+            mono[i] = right != nullptr ? 0.5f * (left[i] + right[i]) : left[i];
+
+        PitchEstimate unresolved = estimate;
+        unresolved.voiced = false;
+
+        for (int divisor = 3; divisor >= 1; --divisor)
+        {
+            const double candidate = coarseLag / divisor;
+            if (candidate + factor + 1 < minimumLag())
+                continue;
+
+            const int firstLag = (int) std::floor(candidate) - factor - 1;
+            auto result = fine->analyseLagBand(mono.data(), firstLag, firstLag + bandLags, unresolved);
+            if (result.voiced)
+                return result;
+        }
+
+        return estimate;
+    }
+
+    int minimumLag() const { return (int) std::floor(sampleRate / config.maxFrequency); }
+
+    double sampleRate;
+    PitchAnalysisConfig config;
+    AnalysisFrontEnd frontEnd;
+    std::unique_ptr<PitchEngine> coarse;
+    std::unique_ptr<PitchDetector> fine;
+
+    static constexpr int maxFramesPerPass = 16;
+
+    std::vector<float> decimated, decimatedSpan, mono;
+    const YinKernels::KernelTable* kernels = &YinKernels::getBestKernels();
+};
+
+//==============================================================================
+/**
+ * Fixed-size block of recording ring storage. A segment is pinned while an
+ * AudioCapture reads from it, and the ring never writes into a pinned one.
+ */
+struct AudioSegment
+{
+    static constexpr int sizeLog2 = 15; // About 0.7s at 48kHz
+    static constexpr int size = 1 << sizeLog2;
+
+    explicit AudioSegment(int numChannels)
+        : audio(numChannels, size)
+    {
+        // Touches every page on the creating thread, so the writer never faults one in
+        audio.clear();
+    }
+
+    /** Index of the segment holding an absolute stream position, rounding towards minus infinity */
+    static juce::int64 indexOf(juce::int64 position)
+    {
+        return position >= 0 ? position >> sizeLog2 : -((-position - 1) >> sizeLog2) - 1;
+    }
+
+    juce::AudioBuffer<float> audio;
+    std::atomic<int> pins { 0 };
+    std::atomic<bool> inUse { true }; // In a ring slot or queued as a spare
+};
+
+//==============================================================================
+/**
+ * Read-only view of a span of recorded audio, read in place from segment-sized
+ * blocks wherever they live: pinned ring segments, a memory-mapped file, or a
+ * buffer of its own. Copies of a capture share one owner, which keeps the
+ * blocks alive and pinned until the last copy goes; a capture of ring
+ * segments must not outlive its ring. Reads that ask for a contiguous run
+ * only gather into the caller's scratch space when the run crosses a
+ * segment boundary.
+ */
+class AudioCapture
+{
+public:
+    AudioCapture() = default;
+
+    /**
+     * channelData holds numChannels pointers per segment, segment after segment,
+     * each to AudioSegment::size samples; the span starts firstOffset samples
+     * into the first segment. owner keeps the data valid.
+     */
+    AudioCapture(std::vector<const float*> segmentChannelData, std::shared_ptr<const void> dataOwner,
+                 juce::int64 absoluteStart, int firstOffset, int numSamplesInCapture, int numChannelsInCapture,
+                 bool isInMemory = true)
+        : channelData(std::move(segmentChannelData)),
+          owner(std::move(dataOwner)),
+          startPosition(absoluteStart),
+          offset(firstOffset),
+          numSamples(numSamplesInCapture),
+          numChannels(numChannelsInCapture),
+          inMemory(isInMemory)
+    {
+        jassert(channelData.size() == (size_t) (numChannels * ((offset + numSamples + AudioSegment::size - 1) >> AudioSegment::sizeLog2)));
+    }
+
+    /** head followed by tail, which must start where head ends, on a segment boundary */
+    static AudioCapture concatenate(const AudioCapture& head, const AudioCapture& tail)
+    {
+        jassert(head.startPosition + head.numSamples == tail.startPosition && tail.offset == 0
+                && ((head.offset + head.numSamples) & (AudioSegment::size - 1)) == 0);
+
+        const int channels = juce::jmin(head.numChannels, tail.numChannels);
+        std::vector<const float*> data;
+
+        for (const auto* part : { &head, &tail })
+            for (size_t segment = 0; segment < part->channelData.size() / (size_t) part->numChannels; ++segment)
+                for (int channel = 0; channel < channels; ++channel)
+                    data.push_back(part->channelData[segment * (size_t) part->numChannels + (size_t) channel]);
+
+        auto owners = std::make_shared<const std::pair<std::shared_ptr<const void>, std::shared_ptr<const void>>>(head.owner, tail.owner);
+
+        return AudioCapture(std::move(data), std::move(owners), head.startPosition, head.offset,
+                            head.numSamples + tail.numSamples, channels, head.inMemory && tail.inMemory);
+    }
+
+    /** A capture of [start, start + length) of source held in a buffer of its own */
+    static AudioCapture copyOf(const AudioCapture& source, int start, int length)
+    {
+        const int numSegments = (length + AudioSegment::size - 1) >> AudioSegment::sizeLog2;
+        auto buffer = std::make_shared<juce::AudioBuffer<float>>(source.numChannels, numSegments * AudioSegment::size);
+        source.copyTo(*buffer, 0, start, length);
+
+        std::vector<const float*> data;
+        for (int segment = 0; segment < numSegments; ++segment)
+            for (int channel = 0; channel < source.numChannels; ++channel)
+                data.push_back(buffer->getReadPointer(channel, segment * AudioSegment::size));
+
+        return AudioCapture(std::move(data), std::move(buffer), source.startPosition + start, 0, length, source.numChannels);
+    }
+
+    int getNumChannels() const { return numChannels; }
+    int getNumSamples() const { return numSamples; }
+
+    /** Absolute position in the ring's write stream of the first sample */
+    juce::int64 getStartPosition() const { return startPosition; }
+
+    /** False if reads may have to fault pages in from disk, which the audio thread must never do */
+    bool isInMemory() const { return inMemory; }
+
+    float getSample(int channel, int index) const
+    {
+        jassert(index >= 0 && index < numSamples);
+        const int position = offset + index;
+        return getSegmentData(position, channel)[position & (AudioSegment::size - 1)];
+    }
+
+    /**
+     * Pointer to length consecutive samples from start: into the segment itself
+     * when the run lies in one, otherwise gathered into scratch, which must hold
+     * length samples.
+     */
+    const float* getReadPointer(int channel, int start, int length, float* scratch) const
+    {
+        jassert(start >= 0 && start + length <= numSamples);
+        const int position = offset + start;
+        const int within = position & (AudioSegment::size - 1);
+
+        if (within + length <= AudioSegment::size)
+            return getSegmentData(position, channel) + within;
+
+        forEachSpan(channel, start, length, [scratch] (const float* data, int index, int count)
+        {
+            std::copy(data, data + count, scratch + index);
+        });
+
+        return scratch;
+    }
+
+    /** Copies [start, start + length) of every channel dest has into dest from destStart */
+    void copyTo(juce::AudioBuffer<float>& dest, int destStart, int start, int length) const
+    {
+        const int channelsToCopy = juce::jmin(dest.getNumChannels(), numChannels);
+
+        for (int channel = 0; channel < channelsToCopy; ++channel)
+        {
+            forEachSpan(channel, start, length, [&] (const float* data, int index, int count)
+            {
+                dest.copyFrom(channel, destStart + index, data, count);
+            });
+        }
+    }
+
+    /** Calls function(data, index, count) for each in-segment run of [start, start + length), index counting from 0 */
+    template <typename Function>
+    void forEachSpan(int channel, int start, int length, Function&& function) const
+    {
+        jassert(start >= 0 && start + length <= numSamples);
+
+        for (int done = 0; done < length;)
+        {
+            const int position = offset + start + done;
+            const int within = position & (AudioSegment::size - 1);
+            const int count = juce::jmin(length - done, AudioSegment::size - within);
+
+            function(getSegmentData(position, channel) + within, done, count);
+            done += count;
+        }
+    }
+
+    /** One segment of silence, for stretches of a capture that were never recorded */
+    static const float* getSilence()
+    {
+        static const std::vector<float> silence((size_t) AudioSegment::size, 0.0f);
+        return silence.data();
+    }
+
+private:
+    const float* getSegmentData(int position, int channel) const
+    {
+        return channelData[(size_t) ((position >> AudioSegment::sizeLog2) * numChannels + channel)];
+    }
+
+    std::vector<const float*> channelData;
+    std::shared_ptr<const void> owner;
+    juce::int64 startPosition = 0;
+    int offset = 0; // Of the first sample, into the first segment
+    int numSamples = 0;
+    int numChannels = 0;
+    bool inMemory = true;
+};
+
+//==============================================================================
+/**
+ * Circular audio buffer to continuously record incoming audio, stored as a
+ * ring of fixed-size AudioSegments with one segment of headroom beyond the
+ * requested length. Samples are addressed by their absolute position in the
+ * write stream; each write is split at segment boundaries and moved as block
+ * copies.
+ *
+ * One writer (the audio thread), and captures taken from any other thread,
+ * which serialise on a lock the writer never takes. A capture freezes the
+ * segments covering its span by pinning them, which takes no copying
+ * whatever its length. When the writer comes round to
+ * a pinned segment it swaps in a spare and leaves the frozen one to the
+ * capture; spares for every pinned segment are queued before pinning, with
+ * their pages already touched by the capturing thread. The writer announces
+ * how far it is about to write before touching any segment and publishes the
+ * new total afterwards, so a capture can tell whether the writer lapped it
+ * while it was pinning, in the manner of a sequence lock. Neither side ever
+ * blocks, and the writer never allocates.
+ */
+class CircularAudioBuffer
+{
+public:
+    CircularAudioBuffer(int numChannelsToRecord, int maxLengthInSamples)
+        : numChannels(numChannelsToRecord),
+          size(maxLengthInSamples),
+          numSlots((maxLengthInSamples + AudioSegment::size - 1) / AudioSegment::size + 1),
+          slots((size_t) numSlots),
+          spares((size_t) numSlots)
+    {
+        // Positions before the first write read back as silence
+        for (auto& slot : slots)
+        {
+            storage.push_back(std::make_unique<AudioSegment>(numChannels));
+            slot.store(storage.back().get());
+        }
+    }
+
+    /** Writer only */
+    void write(const juce::AudioBuffer<float>& sourceBuffer)
+    {
+        const int numSamples = sourceBuffer.getNumSamples();
+        const int channelsToCopy = juce::jmin(sourceBuffer.getNumChannels(), numChannels);
+        const juce::int64 total = totalSamplesWritten.load(std::memory_order_relaxed);
+
+        // Step 1: Announce the overwrite before any segment is touched
+        samplesClaimed.store(total + numSamples, std::memory_order_seq_cst);
+
+        // Step 2: Copy segment by segment; a block longer than the ring only leaves its last size samples behind
+        for (int done = juce::jmax(0, numSamples - size); done < numSamples;)
+        {
+            const juce::int64 position = total + done;
+            const int within = (int) (position & (AudioSegment::size - 1));
+            const int count = juce::jmin(numSamples - done, AudioSegment::size - within);
+            auto& segment = getSegmentForWriting(position, within == 0);
+
+            for (int channel = 0; channel < channelsToCopy; ++channel)
+                segment.audio.copyFrom(channel, within, sourceBuffer, channel, done, count);
+
+            done += count;
+        }
+
+        // Step 3: Publish the new samples
+        totalSamplesWritten.store(total + numSamples, std::memory_order_release);
+    }
+
+    /**
+     * Freezes the most recent numSamples samples. Retries while the writer laps
+     * the oldest of them, so it is meant for captures taken while recording is
+     * stopping or that leave the writer some headroom.
+     */
+    AudioCapture freezeLatest(int numSamples)
+    {
+        jassert(numSamples <= size);
+
+        for (int attempt = 0; attempt < maxFreezeAttempts; ++attempt)
+        {
+            auto capture = freeze(getTotalSamplesWritten() - numSamples, numSamples);
+
+            if (capture.getNumSamples() > 0 || numSamples <= 0)
+                return capture;
+        }
+
+        // The writer kept lapping the capture
+        jassertfalse;
+        return {};
+    }
+
+    /** Freezes [absoluteStart, absoluteStart + numSamples); empty if the ring doesn't hold all of it */
+    AudioCapture freeze(juce::int64 absoluteStart, int numSamples)
+    {
+        if (numSamples <= 0 || ! isAvailable(absoluteStart, numSamples))
+            return {};
+
+        const juce::int64 firstSegment = AudioSegment::indexOf(absoluteStart);
+        const juce::int64 lastSegment = AudioSegment::indexOf(absoluteStart + numSamples - 1);
+
+        std::lock_guard<std::mutex> lock(captureLock);
+
+        // Step 1: A spare for each segment about to be pinned, before the writer can need one
+        queueSpares((int) (lastSegment - firstSegment + 1));
+
+        // Step 2: Pin, then check the writer hadn't claimed the oldest segment's next lap
+        auto pins = std::make_shared<SegmentPins>();
+        std::vector<const float*> channelData;
+
+        for (juce::int64 index = firstSegment; index <= lastSegment; ++index)
+        {
+            auto* segment = slots[getSlot(index)].load(std::memory_order_acquire);
+            segment->pins.fetch_add(1, std::memory_order_seq_cst);
+            pins->segments.push_back(segment);
+
+            for (int channel = 0; channel < numChannels; ++channel)
+                channelData.push_back(segment->audio.getReadPointer(channel));
+        }
+
+        if (samplesClaimed.load(std::memory_order_seq_cst) > (firstSegment + numSlots) * AudioSegment::size)
+            return {};
+
+        return AudioCapture(std::move(channelData), std::move(pins), absoluteStart,
+                            (int) (absoluteStart - firstSegment * AudioSegment::size), numSamples, numChannels);
+    }
+
+    /** True if the span is published and still held by the ring */
+    bool isAvailable(juce::int64 absoluteStart, int numSamples) const
+    {
+        const juce::int64 total = getTotalSamplesWritten();
+        return absoluteStart >= total - size && absoluteStart + numSamples <= total;
+    }
+
+    int getNumChannels() const { return numChannels; }
+    int getSize() const { return size; }
+    juce::int64 getTotalSamplesWritten() const { return totalSamplesWritten.load(std::memory_order_acquire); }
+
+private:
+    static constexpr int maxFreezeAttempts = 8;
+
+    /** Owner of a capture's ring segments; releases the pins with the last copy of the capture */
+    struct SegmentPins
+    {
+        ~SegmentPins()
+        {
+            for (auto* segment : segments)
+                segment->pins.fetch_sub(1, std::memory_order_release);
+        }
+
+        std::vector<AudioSegment*> segments;
+    };
+
+    size_t getSlot(juce::int64 segmentIndex) const { return (size_t) (((segmentIndex % numSlots) + numSlots) % numSlots); }
+
+    /** Writer only: the segment to write position into, moving on from a pinned one when a new lap enters it */
+    AudioSegment& getSegmentForWriting(juce::int64 position, bool enteringSegment)
+    {
+        auto& slot = slots[getSlot(AudioSegment::indexOf(position))];
+        auto* segment = slot.load(std::memory_order_relaxed);
+
+        if (enteringSegment && segment->pins.load(std::memory_order_seq_cst) > 0)
+        {
+            const juce::int64 popped = sparesPopped.load(std::memory_order_relaxed);
+
+            if (popped < sparesPushed.load(std::memory_order_acquire))
+            {
+                auto* spare = spares[(size_t) (popped % numSlots)];
+                sparesPopped.store(popped + 1, std::memory_order_release);
+
+                segment->inUse.store(false, std::memory_order_release);
+                slot.store(spare, std::memory_order_release);
+                segment = spare;
+            }
+            else
+            {
+                // freezeLatest() queues a spare for every segment it pins
+                jassertfalse;
+            }
+        }
+
+        return *segment;
+    }
+
+    /** Caller holds captureLock: tops the spares up to the segments still pinned in the ring plus extra */
+    void queueSpares(int extra)
+    {
+        int needed = extra;
+        for (auto& slot : slots)
+            if (slot.load(std::memory_order_acquire)->pins.load(std::memory_order_acquire) > 0)
+                ++needed;
+
+        needed = juce::jmin(needed, numSlots);
+        juce::int64 pushed = sparesPushed.load(std::memory_order_relaxed);
+
+        while (pushed - sparesPopped.load(std::memory_order_acquire) < needed)
+        {
+            spares[(size_t) (pushed % numSlots)] = findFreeSegment();
+            sparesPushed.store(++pushed, std::memory_order_release);
+        }
+    }
+
+    /** Caller holds captureLock: a segment the writer gave up and no capture reads any more, or a new one */
+    AudioSegment* findFreeSegment()
+    {
+        for (auto& segment : storage)
+        {
+            if (! segment->inUse.load(std::memory_order_acquire) && segment->pins.load(std::memory_order_acquire) == 0)
+            {
+                segment->inUse.store(true, std::memory_order_relaxed);
+                return segment.get();
+            }
+        }
+
+        storage.push_back(std::make_unique<AudioSegment>(numChannels));
+        return storage.back().get();
+    }
+
+    int numChannels;
+    int size;
+    int numSlots;
+    std::vector<std::atomic<AudioSegment*>> slots; // Segment index i lives in slot i % numSlots
+    std::vector<std::unique_ptr<AudioSegment>> storage; // Every segment ever made; grown under captureLock only
+
+    // Spares queued by capturing threads for the writer
+    std::mutex captureLock;
+    std::vector<AudioSegment*> spares;
+    std::atomic<juce::int64> sparesPushed { 0 }, sparesPopped { 0 };
+
+    std::atomic<juce::int64> totalSamplesWritten { 0 }; // Published: every sample before this is in the ring
+    std::atomic<juce::int64> samplesClaimed { 0 };      // Announced: the writer may be writing up to here
+};
+
+//==============================================================================
+/**
+ * Recording history beyond the RAM ring, kept in a memory-mapped file on local
+ * disk. The file holds a ring of segment slots, each with the same planar
+ * layout as an AudioSegment. A background thread first writes the whole file
+ * out with zeros, so every block of it is allocated before it is mapped and
+ * a full disk can't fault a store through the mapping. It then follows the
+ * RAM ring, freezes each segment once the audio thread has finished it and
+ * copies it into its slot, so the audio thread never touches the filesystem.
+ *
+ * Captures read the file in place through the mapping, with the newest
+ * whole segments still coming from the RAM ring. A disk slot is pinned while
+ * a capture reads it, and the writer leaves a pinned slot alone; segments
+ * it couldn't store, or that fell out of the RAM ring before it got to them,
+ * read back as silence.
+ */
+class DiskHistory : private juce::Thread
+{
+public:
+    /** Sets up a file for at least numSamples of history in the background; false from hasFailed() if the volume lacks the space */
+    DiskHistory(CircularAudioBuffer& ringToFollow, const juce::File& historyFile, juce::int64 numSamples)
+        : juce::Thread("Disk history"),
+          ring(ringToFollow),
+          file(historyFile),
+          numSlots((int) ((numSamples + AudioSegment::size - 1) / AudioSegment::size) + 1)
+    {
+        if (file.getParentDirectory().getBytesFreeOnVolume() < Storage::getFileSize(numSlots, ring.getNumChannels()))
+        {
+            failed = true;
+            return;
+        }
+
+        startThread();
+    }
+
+    ~DiskHistory() override
+    {
+        stopThread(5000);
+    }
+
+    /** True once the file is allocated and mapped */
+    bool isReady() const { return ready.load(std::memory_order_acquire); }
+
+    /** True if the file couldn't be allocated or mapped */
+    bool hasFailed() const { return failed.load(std::memory_order_acquire); }
+
+    /** Longest capture the file can serve, in samples; 0 until it is ready */
+    juce::int64 getCapacity() const
+    {
+        return isReady() ? (juce::int64) (numSlots - 1) * AudioSegment::size : 0;
+    }
+
+    /** Absolute position up to which the history thread has gone through the ring's finished segments */
+    juce::int64 getStoredEnd() const { return storedEnd.load(std::memory_order_acquire); }
+
+    /** Freezes the most recent numSamples samples, from the RAM ring where it still holds them and the file before that */
+    AudioCapture freezeLatest(int numSamples)
+    {
+        if (! isReady() || numSamples <= ring.getSize())
+            return ring.freezeLatest(juce::jmin(numSamples, ring.getSize()));
+
+        jassert(numSamples <= getCapacity());
+
+        // Retried like CircularAudioBuffer::freezeLatest() while the audio thread moves the ring on
+        for (int attempt = 0; attempt < maxFreezeAttempts; ++attempt)
+        {
+            const juce::int64 total = ring.getTotalSamplesWritten();
+            const juce::int64 absoluteStart = total - numSamples;
+
+            // The ring serves every whole segment it is sure to still hold
+            const juce::int64 ringStart = (AudioSegment::indexOf(total - ring.getSize()) + 1) * AudioSegment::size;
+            const auto tail = ring.freeze(ringStart, (int) (total - ringStart));
+
+            if (tail.getNumSamples() > 0)
+                return AudioCapture::concatenate(freezeFromDisk(absoluteStart, (int) (ringStart - absoluteStart)), tail);
+        }
+
+        jassertfalse;
+        return {};
+    }
+
+private:
+    /** The mapping and its slots, shared with the captures reading them so they outlive a history that is switched off */
+    struct Storage
+    {
+        struct Slot
+        {
+            std::atomic<juce::int64> segmentIndex { -1 }; // Segment held, -1 if none or while being rewritten
+            std::atomic<int> pins { 0 };
+        };
+
+        static juce::int64 getFileSize(int numSlots, int numChannels)
+        {
+            return (juce::int64) numSlots * numChannels * AudioSegment::size * (juce::int64) sizeof(float);
+        }
+
+        /** Writes the file out in full, then maps it; nullptr if that fails or the thread is asked to stop */
+        static std::shared_ptr<Storage> create(juce::Thread& thread, const juce::File& file, int numSlots, int numChannels)
+        {
+            const juce::int64 fileSize = getFileSize(numSlots, numChannels);
+
+            // Step 1: Write zeros rather than seeking to the end, which would leave the file sparse
+            file.deleteFile();
+            {
+                juce::FileOutputStream stream(file);
+                const std::vector<char> zeros((size_t) 1 << 20, 0);
+                bool written = stream.openedOk();
+
+                for (juce::int64 done = 0; written && done < fileSize; done += (juce::int64) zeros.size())
+                    written = ! thread.threadShouldExit() && stream.write(zeros.data(), (size_t) juce::jmin((juce::int64) zeros.size(), fileSize - done));
+
+                if (written)
+                {
+                    stream.flush();
+                    written = stream.getStatus().wasOk();
+                }
+
+                if (! written)
+                {
+                    file.deleteFile();
+                    return nullptr;
+                }
+            }
+
+            // Step 2: Map it
+            auto storage = std::make_shared<Storage>();
+            storage->file = file;
+            storage->mapping = std::make_unique<juce::MemoryMappedFile>(file, juce::MemoryMappedFile::readWrite);
+
+            if (storage->mapping->getData() == nullptr || (juce::int64) storage->mapping->getSize() < fileSize)
+                return nullptr;
+
+            storage->numSlots = numSlots;
+            storage->numChannels = numChannels;
+            storage->slots = std::vector<Slot>((size_t) numSlots);
+            return storage;
+        }
+
+        ~Storage()
+        {
+            mapping = nullptr;
+            file.deleteFile();
+        }
+
+        float* getChannelData(size_t slot, int channel) const
+        {
+            return static_cast<float*>(mapping->getData()) + (slot * (size_t) numChannels + (size_t) channel) * AudioSegment::size;
+        }
+
+        juce::File file;
+        std::unique_ptr<juce::MemoryMappedFile> mapping;
+        std::vector<Slot> slots; // Segment index i lives in slot i % numSlots
+        int numSlots = 0;
+        int numChannels = 0;
+    };
+
+    /** Owner of a capture's disk slots; releases the pins with the last copy of the capture */
+    struct SlotPins
+    {
+        ~SlotPins()
+        {
+            for (auto* slot : slots)
+                slot->pins.fetch_sub(1, std::memory_order_release);
+        }
+
+        std::shared_ptr<Storage> storage;
+        std::vector<Storage::Slot*> slots;
+    };
+
+    static constexpr int maxFreezeAttempts = 8;
+
+    size_t getSlot(juce::int64 segmentIndex) const { return (size_t) (segmentIndex % storage->numSlots); }
+
+    void run() override
+    {
+        storage = Storage::create(*this, file, numSlots, ring.getNumChannels());
+
+        if (storage == nullptr)
+        {
+            failed.store(true, std::memory_order_release);
+            return;
+        }
+
+        // Start with whatever the RAM ring still holds
+        nextSegment = juce::jmax((juce::int64) 0, AudioSegment::indexOf(ring.getTotalSamplesWritten() - ring.getSize()) + 1);
+        ready.store(true, std::memory_order_release);
+
+        while (! threadShouldExit())
+        {
+            storeFinishedSegments();
+            wait(50);
+        }
+    }
+
+    /** Copies every segment the audio thread has finished since the last pass into its slot */
+    void storeFinishedSegments()
+    {
+        const juce::int64 total = ring.getTotalSamplesWritten();
+        const juce::int64 finishedSegments = AudioSegment::indexOf(total);
+
+        // Segments the RAM ring lapped before they could be stored are lost
+        nextSegment = juce::jmax(nextSegment, AudioSegment::indexOf(total - ring.getSize()) + 1);
+
+        for (; nextSegment < finishedSegments && ! threadShouldExit(); ++nextSegment)
+        {
+            const auto segment = ring.freeze(nextSegment * AudioSegment::size, AudioSegment::size);
+
+            if (segment.getNumSamples() == 0)
+                continue;
+
+            // Step 1: Take the slot over, unless a capture still reads the segment it holds
+            const size_t slotIndex = getSlot(nextSegment);
+            auto& slot = storage->slots[slotIndex];
+            const juce::int64 previous = slot.segmentIndex.load(std::memory_order_relaxed);
+
+            slot.segmentIndex.store(-1, std::memory_order_seq_cst);
+
+            if (slot.pins.load(std::memory_order_seq_cst) > 0)
+            {
+                slot.segmentIndex.store(previous, std::memory_order_release);
+                continue;
+            }
+
+            // Step 2: Copy, then publish
+            for (int channel = 0; channel < storage->numChannels; ++channel)
+            {
+                float* dest = storage->getChannelData(slotIndex, channel);
+
+                segment.forEachSpan(channel, 0, AudioSegment::size, [dest] (const float* data, int index, int count)
+                {
+                    std::copy(data, data + count, dest + index);
+                });
+            }
+
+            slot.segmentIndex.store(nextSegment, std::memory_order_release);
+        }
+
+        storedEnd.store(nextSegment * AudioSegment::size, std::memory_order_release);
+    }
+
+    /** The file's part of a capture: whole segments from absoluteStart, length samples long */
+    AudioCapture freezeFromDisk(juce::int64 absoluteStart, int length) const
+    {
+        const juce::int64 firstSegment = AudioSegment::indexOf(absoluteStart);
+        const juce::int64 endSegment = AudioSegment::indexOf(absoluteStart + length - 1) + 1;
+
+        auto pins = std::make_shared<SlotPins>();
+        pins->storage = storage;
+        std::vector<const float*> channelData;
+
+        for (juce::int64 index = firstSegment; index < endSegment; ++index)
+        {
+            // Pin, then check the slot still holds this segment
+            auto* slot = index >= 0 ? &storage->slots[getSlot(index)] : nullptr;
+
+            if (slot != nullptr)
+            {
+                slot->pins.fetch_add(1, std::memory_order_seq_cst);
+
+                if (slot->segmentIndex.load(std::memory_order_seq_cst) != index)
+                {
+                    slot->pins.fetch_sub(1, std::memory_order_release);
+                    slot = nullptr;
+                }
+                else
+                {
+                    pins->slots.push_back(slot);
+                }
+            }
+
+            for (int channel = 0; channel < storage->numChannels; ++channel)
+                channelData.push_back(slot != nullptr ? storage->getChannelData(getSlot(index), channel) : AudioCapture::getSilence());
+        }
+
+        return AudioCapture(std::move(channelData), std::move(pins), absoluteStart,
+                            (int) (absoluteStart - firstSegment * AudioSegment::size), length, storage->numChannels, false);
+    }
+
+    CircularAudioBuffer& ring;
+    const juce::File file;
+    const int numSlots;
+    std::shared_ptr<Storage> storage; // Set by the history thread before ready
+    std::atomic<bool> ready { false }, failed { false };
+    juce::int64 nextSegment = 0; // Next segment to store; written by the history thread only
+    std::atomic<juce::int64> storedEnd { 0 };
+};
+
+//==============================================================================
+/**
+ * Incremental pitch tracker fed from the audio thread while recording.
+ * Stores one estimate per hop in a ring that covers the same span as the
+ * history held in RAM, so frame k always describes the window starting at
+ * absolute sample startPosition + k * hopSize of the buffer's write stream.
+ * Fine hops on undecimated YIN use the sliding detector, whose cost per hop
+ * shrinks with the hop, so the tracker picks an eighth-window hop wherever
+ * it applies; everything else analyses each window in full.
+ *
+ * A config change builds a new detector and frame ring on the message thread
+ * and hands it over like the processor's preview sources: published through an
+ * atomic pointer, guarded by a hazard pointer while the audio thread adopts it,
+ * and freed on the message thread once the audio thread has moved on. The new
+ * one starts framing at the first block after the switch, so only the frames
+ * before it belong to the old config.
+ */
+class StreamingPitchTracker
+{
+public:
+    StreamingPitchTracker() = default;
+
+    /** Allocates everything the audio thread needs. Call from prepareToPlay only. */
+    void prepare(double newSampleRate, int ringLengthInSamples, juce::int64 absolutePosition,
+                 const PitchAnalysisConfig& config)
+    {
+        sampleRate = newSampleRate;
+        ringLength = ringLengthInSamples;
+
+        trackings.clear();
+        trackings.push_back(std::make_unique<Tracking>(sampleRate, ringLength, config));
+        trackings.back()->reset(absolutePosition);
+
+        active.store(trackings.back().get());
+        published.store(trackings.back().get());
+        inUse.store(nullptr);
+    }
+
+    /**
+     * Message thread: builds a tracking for config and publishes it; the audio
+     * thread switches over at the start of its next block. Does nothing before
+     * prepare().
+     */
+    void setConfig(const PitchAnalysisConfig& config)
+    {
+        if (trackings.empty())
+            return;
+
+        trackings.push_back(std::make_unique<Tracking>(sampleRate, ringLength, config));
+        published.store(trackings.back().get());
+        releaseRetired();
+    }
+
+    /**
+     * The configured tracking hop, or else an eighth of the window wherever the
+     * sliding detector can take it. Full-window analyses stay at half-window hops
+     * on the audio thread, whatever overlap the capture analysis uses.
+     */
+    static int chooseHopSize(double sampleRate, const PitchAnalysisConfig& config)
+    {
+        if (config.trackingHopSize > 0)
+            return config.trackingHopSize;
+
+        const int fineHop = config.windowSize / 8;
+        return usesSlidingYin(sampleRate, config, fineHop) ? fineHop : config.windowSize / 2;
+    }
+
+    /** Sliding YIN wins once the hop is small against the window, unless decimation by 4 or more is available */
+    static bool usesSlidingYin(double sampleRate, const PitchAnalysisConfig& config, int hop)
+    {
+        return config.engine == PitchEngineType::YIN
+            && AnalysisFrontEnd::chooseFactor(sampleRate, config) <= 2
+            && hop <= config.windowSize / 8
+            && config.windowSize % hop == 0;
+    }
+
+    /** Audio thread: consumes one block, running at most one analysis per completed hop */
+    void process(const juce::AudioBuffer<float>& block)
+    {
+        auto* current = active.load();
+
+        if (current == nullptr || block.getNumChannels() == 0)
+            return;
+
+        // Adopt a newly published tracking: mark it in use, then check it is still the published one,
+        // so the message thread can't free it meanwhile
+        auto* next = published.load();
+
+        if (next != current)
+        {
+            inUse.store(next);
+
+            if (published.load() == next)
+            {
+                next->reset(current->getEndPosition());
+                active.store(next);
+                current = next;
+            }
+
+            inUse.store(nullptr);
+        }
+
+        current->process(block);
+    }
+
+    /**
+     * Message thread: copies the estimates whose windows lie entirely inside the
+     * absolute sample range [absoluteStart, absoluteEnd). Returns the absolute
+     * position of the first copied frame; frame i of the result starts
+     * getHopSize() * i samples after it.
+     */
+    juce::int64 copyFrames(juce::int64 absoluteStart, juce::int64 absoluteEnd, std::vector<PitchEstimate>& dest) const
+    {
+        dest.clear();
+
+        const auto* current = active.load();
+        return current != nullptr ? current->copyFrames(absoluteStart, absoluteEnd, dest) : absoluteStart;
+    }
+
+    /** Message thread: config, window and hop of the frames copyFrames() returns */
+    PitchAnalysisConfig getConfig() const { return active.load() != nullptr ? active.load()->config : PitchAnalysisConfig(); }
+    int getWindowSize() const { return active.load() != nullptr ? active.load()->windowSize : 0; }
+    int getHopSize() const { return active.load() != nullptr ? active.load()->hopSize : 1; }
+
+    /** Message thread: frees trackings the audio thread has switched away from */
+    void releaseRetired()
+    {
+        // The hazard first: if the audio thread had already finished adopting, active shows it
+        const auto* adopting = inUse.load();
+        const auto* current = active.load();
+        const auto* latest = published.load();
+
+        trackings.erase(std::remove_if(trackings.begin(), trackings.end(), [&] (const std::unique_ptr<Tracking>& tracking)
+        {
+            return tracking.get() != current && tracking.get() != latest && tracking.get() != adopting;
+        }), trackings.end());
+    }
+
+private:
+    /** Detector, frame ring and framing state for one config */
+    struct Tracking
+    {
+        Tracking(double sampleRate, int ringLengthInSamples, const PitchAnalysisConfig& trackingConfig)
+            : config(trackingConfig),
+              windowSize(trackingConfig.windowSize),
+              hopSize(juce::jlimit(1, windowSize, chooseHopSize(sampleRate, trackingConfig)))
+        {
+            if (usesSlidingYin(sampleRate, config, hopSize))
+            {
+                slidingDetector = std::make_unique<SlidingYinDetector>(sampleRate, config, hopSize);
+                frameBuffer.assign(hopSize, 0.0f);
+            }
+            else
+            {
+                detector = std::make_unique<DecimatingPitchDetector>(sampleRate, config);
+                frameBuffer.assign(windowSize, 0.0f);
+                rightFrameBuffer.assign(windowSize, 0.0f);
+            }
+
+            frames.assign(ringLengthInSamples / hopSize + 1, PitchEstimate());
+        }
+
+        /** Restarts tracking with the next processed sample at the given absolute position */
+        void reset(juce::int64 absolutePosition)
+        {
+            samplesInFrame = 0;
+            startPosition = absolutePosition;
+            totalSamples = 0;
+            numFramesWritten.store(0, std::memory_order_release);
+
+            if (slidingDetector != nullptr)
+                slidingDetector->reset();
+        }
+
+        /** Absolute position of the next sample to process */
+        juce::int64 getEndPosition() const { return startPosition + totalSamples; }
+
+        void process(const juce::AudioBuffer<float>& block)
+        {
+            if (slidingDetector != nullptr)
+            {
+                processSliding(block);
+                return;
+            }
+
+            const float* input = block.getReadPointer(0);
+            const float* rightInput = block.getReadPointer(juce::jmin(1, block.getNumChannels() - 1));
+            int remaining = block.getNumSamples();
+
+            while (remaining > 0)
+            {
+                const int toCopy = juce::jmin(remaining, windowSize - samplesInFrame);
+                std::copy(input, input + toCopy, frameBuffer.begin() + samplesInFrame);
+                std::copy(rightInput, rightInput + toCopy, rightFrameBuffer.begin() + samplesInFrame);
+
+                input += toCopy;
+                rightInput += toCopy;
+                remaining -= toCopy;
+                samplesInFrame += toCopy;
+                totalSamples += toCopy;
+
+                if (samplesInFrame == windowSize)
+                {
+                    // The full window starts at totalSamples - windowSize, which is a multiple of hopSize
+                    const juce::int64 frameIndex = (totalSamples - windowSize) / hopSize;
+                    frames[(size_t) (frameIndex % (juce::int64) frames.size())] = detector->analysePitch(frameBuffer.data(), rightFrameBuffer.data(), windowSize);
+                    numFramesWritten.store(frameIndex + 1, std::memory_order_release);
+
+                    // Slide by one hop
+                    std::copy(frameBuffer.begin() + hopSize, frameBuffer.end(), frameBuffer.begin());
+                    std::copy(rightFrameBuffer.begin() + hopSize, rightFrameBuffer.end(), rightFrameBuffer.begin());
+                    samplesInFrame -= hopSize;
+                }
+            }
+        }
+
+        /** Downmixes into frameBuffer, one hop at a time, and advances the sliding detector */
+        void processSliding(const juce::AudioBuffer<float>& block)
+        {
+            const float* input = block.getReadPointer(0);
+            const float* rightInput = block.getReadPointer(juce::jmin(1, block.getNumChannels() - 1));
+            int remaining = block.getNumSamples();
+
+            while (remaining > 0)
+            {
+                const int toCopy = juce::jmin(remaining, hopSize - samplesInFrame);
+                for (int i = 0; i < toCopy; ++i)
+                    frameBuffer[(size_t) (samplesInFrame + i)] = 0.5f * (input[i] + rightInput[i]);
+
+                input += toCopy;
+                rightInput += toCopy;
+                remaining -= toCopy;
+                samplesInFrame += toCopy;
+                totalSamples += toCopy;
+
+                if (samplesInFrame == hopSize)
+                {
+                    const auto estimate = slidingDetector->pushHop(frameBuffer.data());
+                    samplesInFrame = 0;
+
+                    if (slidingDetector->isPrimed())
+                    {
+                        const juce::int64 frameIndex = (totalSamples - windowSize) / hopSize;
+                        frames[(size_t) (frameIndex % (juce::int64) frames.size())] = estimate;
+                        numFramesWritten.store(frameIndex + 1, std::memory_order_release);
+                    }
+                }
+            }
+        }
+
+        juce::int64 copyFrames(juce::int64 absoluteStart, juce::int64 absoluteEnd, std::vector<PitchEstimate>& dest) const
+        {
+            const juce::int64 written = numFramesWritten.load(std::memory_order_acquire);
+            const juce::int64 oldestAvailable = juce::jmax((juce::int64) 0, written - (juce::int64) frames.size() + 1);
+            const juce::int64 relativeStart = juce::jmax((juce::int64) 0, absoluteStart - startPosition);
+
+            const juce::int64 firstFrame = juce::jmax(oldestAvailable, (relativeStart + hopSize - 1) / hopSize);
+
+            for (juce::int64 frame = firstFrame; frame < written && startPosition + frame * hopSize + windowSize <= absoluteEnd; ++frame)
+                dest.push_back(frames[(size_t) (frame % (juce::int64) frames.size())]);
+
+            return startPosition + firstFrame * hopSize;
+        }
+
+        const PitchAnalysisConfig config;
+        const int windowSize;
+        const int hopSize;
+
+        std::unique_ptr<DecimatingPitchDetector> detector;
+        std::unique_ptr<SlidingYinDetector> slidingDetector;
+        std::vector<float> frameBuffer, rightFrameBuffer; // Sliding mode keeps one downmixed hop in frameBuffer
+        int samplesInFrame = 0;
+        juce::int64 startPosition = 0;
+        juce::int64 totalSamples = 0;
+
+        std::vector<PitchEstimate> frames;
+        std::atomic<juce::int64> numFramesWritten { 0 };
+    };
+
+    double sampleRate = 48000.0;
+    int ringLength = 0;
+
+    std::atomic<Tracking*> active { nullptr };    // Written by the audio thread once prepared
+    std::atomic<Tracking*> published { nullptr }; // Latest config from the message thread
+    std::atomic<Tracking*> inUse { nullptr };     // Set by the audio thread only while it adopts published
+    std::vector<std::unique_ptr<Tracking>> trackings; // Message thread: every tracking not yet released
+};
+
+//==============================================================================
+/**
+ * Onset and offset detector fed from the audio thread while recording, next to
+ * the StreamingPitchTracker. The downmixed level of each short hop drives an
+ * energy-derivative detection function:
+ *   - an onset is a rise of onsetRiseDb over the quietest of the last few hops
+ *     (or any climb out of silence), at least minimumGap after the previous one;
+ *   - an offset is the first hop of a stretch at least offsetHold long that
+ *     stays under the noise gate or 40 dB below the peak since the onset.
+ * Events go to a ring stamped with absolute sample positions, so trim points
+ * can be proposed without scanning the capture. Onsets are at least
+ * minimumGap apart and each offset follows one, which bounds how many events
+ * a span can hold; the ring is sized for the longest span prepare() is given.
+ */
+class StreamingOnsetDetector
+{
+public:
+    struct Event
+    {
+        juce::int64 position = 0; // Absolute position of the hop the event was found in
+        float strength = 0.0f;    // Level rise in dB for onsets, 0 for offsets
+        bool isOnset = true;
+    };
+
+    /**
+     * Allocates everything the audio thread needs, keeping every event of the
+     * last longestSpanInSamples samples. Call from prepareToPlay only.
+     */
+    void prepare(double sampleRate, juce::int64 absolutePosition, float silenceThreshold, juce::int64 longestSpanInSamples)
+    {
+        hopSize = juce::jmax(16, juce::roundToInt(sampleRate * hopSeconds));
+        minimumGapHops = juce::jmax(1, juce::roundToInt(minimumGapSeconds * sampleRate / hopSize));
+        offsetHoldHops = juce::jmax(1, juce::roundToInt(offsetHoldSeconds * sampleRate / hopSize));
+        setSilenceThreshold(silenceThreshold);
+
+        // An onset and an offset per minimum gap at most, plus the one slot copyEvents() leaves to the writer
+        const juce::int64 onsetsInSpan = longestSpanInSamples / ((juce::int64) minimumGapHops * hopSize) + 1;
+        events.assign((size_t) (2 * onsetsInSpan + 1), Event());
+
+        reset(absolutePosition);
+    }
+
+    /** Noise gate for onsets and offsets; safe to call from any thread, and applies from the next hop */
+    void setSilenceThreshold(float silenceThreshold)
+    {
+        gateDb.store(juce::Decibels::gainToDecibels(silenceThreshold, -120.0f), std::memory_order_relaxed);
+    }
+
+    /** Restarts detection with the next processed sample at the given absolute position */
+    void reset(juce::int64 absolutePosition)
+    {
+        startPosition = absolutePosition;
+        totalHops = 0;
+        samplesInHop = 0;
+        hopEnergy = 0.0;
+        recentLevels.fill(-120.0f);
+        active = false;
+        peakDb = -120.0f;
+        hopsSinceOnset = minimumGapHops;
+        quietHops = 0;
+        numEventsWritten.store(0, std::memory_order_release);
+    }
+
+    /** Audio thread: consumes one block; a few operations per sample plus one log per hop */
+    void process(const juce::AudioBuffer<float>& block)
+    {
+        if (block.getNumChannels() == 0 || events.empty())
+            return;
+
+        const float* left = block.getReadPointer(0);
+        const float* right = block.getReadPointer(juce::jmin(1, block.getNumChannels() - 1));
+        const int numSamples = block.getNumSamples();
+
+        for (int i = 0; i < numSamples;)
+        {
+            const int toAdd = juce::jmin(numSamples - i, hopSize - samplesInHop);
+
+            for (int j = i; j < i + toAdd; ++j)
+            {
+                const float mono = 0.5f * (left[j] + right[j]);
+                hopEnergy += (double) mono * mono;
+            }
+
+            i += toAdd;
+            samplesInHop += toAdd;
+
+            if (samplesInHop == hopSize)
+                finishHop();
+        }
+    }
+
+    /**
+     * Copies the events found in the absolute range [absoluteStart, absoluteEnd),
+     * oldest first. Returns false if the ring has dropped events that may have
+     * been in the range, in which case dest only holds the newer ones.
+     */
+    bool copyEvents(juce::int64 absoluteStart, juce::int64 absoluteEnd, std::vector<Event>& dest) const
+    {
+        dest.clear();
+
+        if (events.empty())
+            return true;
+
+        const juce::int64 numSlots = (juce::int64) events.size();
+        const juce::int64 written = numEventsWritten.load(std::memory_order_acquire);
+        const juce::int64 oldestAvailable = juce::jmax((juce::int64) 0, written - numSlots + 1);
+
+        // Step 1: Copy everything available, then drop whatever the audio thread overwrote meanwhile
+        for (juce::int64 n = oldestAvailable; n < written; ++n)
+            dest.push_back(events[(size_t) (n % numSlots)]);
+
+        const juce::int64 oldestIntact = juce::jmax((juce::int64) 0, numEventsWritten.load(std::memory_order_acquire) - numSlots + 1);
+        dest.erase(dest.begin(), dest.begin() + (std::ptrdiff_t) juce::jmin((juce::int64) dest.size(), oldestIntact - oldestAvailable));
+
+        // Step 2: Lost events all came before the oldest intact one, so they only matter if that is inside the range
+        const bool complete = oldestIntact == 0 || (! dest.empty() && dest.front().position < absoluteStart);
+
+        dest.erase(std::remove_if(dest.begin(), dest.end(), [&] (const Event& event)
+                   {
+                       return event.position < absoluteStart || event.position >= absoluteEnd;
+                   }),
+                   dest.end());
+
+        return complete;
+    }
+
+    int getHopSize() const { return hopSize; }
+
+    /** Time the level must stay down before an offset is declared */
+    static constexpr double offsetHoldSeconds = 0.05;
+
+private:
+    static constexpr double hopSeconds = 0.005;
+    static constexpr double minimumGapSeconds = 0.05;
+    static constexpr float onsetRiseDb = 9.0f;
+    static constexpr float offsetDropDb = 40.0f;
+
+    void finishHop()
+    {
+        const float level = juce::Decibels::gainToDecibels((float) std::sqrt(hopEnergy / hopSize), -120.0f);
+        const juce::int64 position = startPosition + totalHops * hopSize;
+        const float gate = gateDb.load(std::memory_order_relaxed);
+
+        // Step 1: Rise over the quietest recent hop, with silence counted as the gate level
+        const float floor = juce::jmax(gate, *std::min_element(recentLevels.begin(), recentLevels.end()));
+        const float rise = level - floor;
+
+        if (level > gate && hopsSinceOnset >= minimumGapHops && (rise >= onsetRiseDb || ! active))
+        {
+            addEvent({ position, rise, true });
+            active = true;
+            peakDb = level;
+            hopsSinceOnset = 0;
+            quietHops = 0;
+        }
+        else if (active)
+        {
+            // Step 2: Offset once the level has stayed down for the hold time
+            peakDb = juce::jmax(peakDb, level);
+
+            if (level < juce::jmax(gate, peakDb - offsetDropDb))
+            {
+                if (++quietHops == offsetHoldHops)
+                {
+                    addEvent({ position - (juce::int64) (offsetHoldHops - 1) * hopSize, 0.0f, false });
+                    active = false;
+                }
+            }
+            else
+            {
+                quietHops = 0;
+            }
+        }
+
+        std::rotate(recentLevels.begin(), recentLevels.begin() + 1, recentLevels.end());
+        recentLevels.back() = level;
+
+        ++hopsSinceOnset;
+        ++totalHops;
+        samplesInHop = 0;
+        hopEnergy = 0.0;
+    }
+
+    void addEvent(const Event& event)
+    {
+        const juce::int64 index = numEventsWritten.load(std::memory_order_relaxed);
+        events[(size_t) (index % (juce::int64) events.size())] = event;
+        numEventsWritten.store(index + 1, std::memory_order_release);
+    }
+
+    int hopSize = 240;
+    int minimumGapHops = 10;
+    int offsetHoldHops = 10;
+    std::atomic<float> gateDb { -60.0f };
+
+    juce::int64 startPosition = 0;
+    juce::int64 totalHops = 0;
+    int samplesInHop = 0;
+    double hopEnergy = 0.0;
+    std::array<float, 4> recentLevels {}; // Last 20 ms of hop levels, oldest first
+    bool active = false;                  // Between an onset and its offset
+    float peakDb = -120.0f;
+    int hopsSinceOnset = 0;
+    int quietHops = 0;
+
+    std::vector<Event> events;
+    std::atomic<juce::int64> numEventsWritten { 0 };
+};
+
+//==============================================================================
+/**
+ * Allocation-free pitch statistics over analysed frames. A voiced frame adds its
+ * weight, YIN confidence times RMS level, to the nearest MIDI note, together with
+ * its weighted offset from that note in cents. The dominant note and its tuning
+ * therefore come out of one pass at sub-cent resolution, while quiet or doubtful
+ * frames count for less. Everything lives in fixed-size arrays, so results from
+ * parallel workers merge with one element-wise sum.
+ */
+class PitchStatistics
+{
+public:
+    static constexpr int numNotes = 128;
+
+    /** One frame's contribution; note is -1 for an unvoiced or out-of-range frame */
+    struct Frame
+    {
+        int note = -1;
+        float cents = 0.0f; // Offset from note, in [-50, 50]
+        float weight = 0.0f;
+
+        static Frame fromEstimate(const PitchEstimate& estimate)
+        {
+            Frame frame;
+
+            if (! estimate.voiced || estimate.frequency <= 0.0f)
+                return frame;
+
+            const float midiNote = PitchConversion::midiNoteFromFrequency(estimate.frequency);
+            const int nearest = juce::roundToInt(midiNote);
+
+            if (nearest < 0 || nearest >= numNotes)
+                return frame;
+
+            frame.note = nearest;
+            frame.cents = 100.0f * (midiNote - (float) nearest);
+            frame.weight = juce::jmax(0.0f, estimate.confidence) * estimate.rms;
+            return frame;
+        }
+    };
+
+    PitchStatistics() { clear(); }
+
+    void clear()
+    {
+        weights.fill(0.0f);
+        centsMoments.fill(0.0f);
+    }
+
+    void add(const Frame& frame)
+    {
+        if (frame.note < 0 || frame.note >= numNotes)
+            return;
+
+        weights[(size_t) frame.note] += frame.weight;
+        centsMoments[(size_t) frame.note] += frame.weight * frame.cents;
+    }
+
+    void merge(const PitchStatistics& other)
+    {
+        for (int note = 0; note < numNotes; ++note)
+        {
+            weights[(size_t) note] += other.weights[(size_t) note];
+            centsMoments[(size_t) note] += other.centsMoments[(size_t) note];
+        }
+    }
+
+    /** Sets one note's totals, e.g. the difference of two prefix sums */
+    void setNote(int note, double weight, double centsMoment)
+    {
+        weights[(size_t) note] = (float) weight;
+        centsMoments[(size_t) note] = (float) centsMoment;
+    }
+
+    float getWeight(int note) const { return weights[(size_t) note]; }
+
+    /** Note with the largest weight (the lowest one on a tie), -1 if no voiced frames */
+    int getMostCommonNote() const
+    {
+        int best = -1;
+        float bestWeight = 0.0f;
+
+        for (int note = 0; note < numNotes; ++note)
+        {
+            if (weights[(size_t) note] > bestWeight)
+            {
+                bestWeight = weights[(size_t) note];
+                best = note;
+            }
+        }
+
+        return best;
+    }
+
+    /** Weighted mean offset in cents of the frames on the most common note, 0 if none */
+    float getFineTuneCents() const
+    {
+        const int note = getMostCommonNote();
+
+        if (note < 0)
+            return 0.0f;
+
+        return juce::jlimit(-50.0f, 50.0f, centsMoments[(size_t) note] / weights[(size_t) note]);
+    }
+
+private:
+    std::array<float, numNotes> weights, centsMoments;
+};
+
+//==============================================================================
+/**
+ * Sorted zero-crossing positions of each channel of a capture, built in
+ * one pass, so trim points can snap to a crossing by binary search instead of
+ * starting a sample mid-waveform. Position i means the sign changes between
+ * samples i - 1 and i.
+ */
+class ZeroCrossingIndex
+{
+public:
+    void build(const AudioCapture& source) { build(source, 0, source.getNumSamples()); }
+
+    /** Indexes only the crossings inside [start, start + length) */
+    void build(const AudioCapture& source, int start, int length)
+    {
+        channels.resize((size_t) source.getNumChannels());
+
+        for (int channel = 0; channel < source.getNumChannels(); ++channel)
+        {
+            auto& crossings = channels[(size_t) channel];
+            crossings.clear();
+
+            // Segment by segment, carrying the last sample of each into the next
+            float previous = start > 0 ? source.getSample(channel, start - 1) : 0.0f;
+            source.forEachSpan(channel, start, length, [&] (const float* samples, int index, int count)
+            {
+                findCrossings(samples, count, start + index, start + index > 0 ? previous : samples[0], crossings);
+                previous = samples[count - 1];
+            });
+        }
+    }
+
+    void clear() { channels.clear(); }
+    bool isEmpty() const { return channels.empty(); }
+
+    /**
+     * The crossing nearest to position, across all channels, that leaves the
+     * smallest total level at the cut; position itself if none lies within
+     * maxDistance samples.
+     */
+    int snap(const AudioCapture& source, int position, int maxDistance) const
+    {
+        int best = position;
+        float bestLevel = std::numeric_limits<float>::max();
+
+        for (const auto& crossings : channels)
+        {
+            // The crossings either side of position
+            const auto next = std::lower_bound(crossings.begin(), crossings.end(), position);
+
+            for (auto it : { next, next != crossings.begin() ? next - 1 : crossings.end() })
+            {
+                if (it == crossings.end() || std::abs(*it - position) > maxDistance)
+                    continue;
+
+                const float level = levelAt(source, *it);
+                if (level < bestLevel || (level == bestLevel && std::abs(*it - position) < std::abs(best - position)))
+                {
+                    bestLevel = level;
+                    best = *it;
+                }
+            }
+        }
+
+        return best;
+    }
+
+    size_t getNumCrossings(int channel) const { return channels[(size_t) channel].size(); }
+
+private:
+    /**
+     * Appends the sign changes of a run of samples starting at firstPosition,
+     * with previous the sample before it. Gathered 64 samples to a mask word,
+     * then read out one set bit at a time.
+     */
+    static void findCrossings(const float* samples, int count, int firstPosition, float previous, std::vector<int>& crossings)
+    {
+        for (int base = 0; base < count; base += 64)
+        {
+            const int length = juce::jmin(64, count - base);
+            juce::uint64 mask = 0;
+
+            mask |= (juce::uint64) ((base > 0 ? samples[base - 1] : previous) < 0.0f) != (samples[base] < 0.0f);
+            for (int j = 1; j < length; ++j)
+                mask |= (juce::uint64) ((samples[base + j - 1] < 0.0f) != (samples[base + j] < 0.0f)) << j;
+
+            for (; mask != 0; mask &= mask - 1)
+                crossings.push_back(firstPosition + base + juce::countNumberOfBits((mask & (~mask + 1)) - 1));
+        }
+    }
+
+    /** Summed level of all channels either side of the cut at position */
+    static float levelAt(const AudioCapture& source, int position)
+    {
+        float level = 0.0f;
+
+        for (int channel = 0; channel < source.getNumChannels(); ++channel)
+            level += juce::jmin(std::abs(source.getSample(channel, position - 1)), std::abs(source.getSample(channel, position)));
+
+        return level;
+    }
+
+    std::vector<std::vector<int>> channels;
+};
+
+//==============================================================================
+/**
+ * Lowest and highest sample of the first channel in each of a fixed number of
+ * equal columns of a capture, gathered once when the capture is frozen, so
+ * the waveform can be drawn at any width without reading the capture again.
+ */
+class WaveformOverview
+{
+public:
+    static constexpr int numColumns = 4096;
+
+    /**
+     * Reads all of an in-memory capture. A capture on disk is read a run of
+     * maxRunFromDisk samples per column, which keeps the pages touched bounded
+     * for an hour-long capture at the cost of missing peaks between the runs.
+     */
+    void build(const AudioCapture& source)
+    {
+        clear();
+        numSamples = source.getNumSamples();
+
+        if (numSamples == 0 || source.getNumChannels() == 0)
+            return;
+
+        minima.resize((size_t) numColumns);
+        maxima.resize((size_t) numColumns);
+
+        for (int column = 0; column < numColumns; ++column)
+        {
+            // With more columns than samples, a column shows the sample it falls within
+            const int start = getColumnStart(column);
+            const int end = juce::jmax(start + 1, getColumnStart(column + 1));
+            const int length = source.isInMemory() ? end - start : juce::jmin(end - start, maxRunFromDisk);
+            float lowest = std::numeric_limits<float>::max();
+            float highest = std::numeric_limits<float>::lowest();
+
+            source.forEachSpan(0, start, length, [&] (const float* samples, int, int count)
+            {
+                const auto range = juce::FloatVectorOperations::findMinAndMax(samples, count);
+                lowest = juce::jmin(lowest, range.getStart());
+                highest = juce::jmax(highest, range.getEnd());
+            });
+
+            minima[(size_t) column] = lowest;
+            maxima[(size_t) column] = highest;
+        }
+    }
+
+    void clear()
+    {
+        minima.clear();
+        maxima.clear();
+        numSamples = 0;
+    }
+
+    bool isEmpty() const { return minima.empty(); }
+
+    /** Lowest and highest sample over columns [firstColumn, endColumn) */
+    juce::Range<float> getRange(int firstColumn, int endColumn) const
+    {
+        jassert(! isEmpty() && firstColumn >= 0 && firstColumn < endColumn && endColumn <= numColumns);
+
+        const float lowest = *std::min_element(minima.begin() + firstColumn, minima.begin() + endColumn);
+        const float highest = *std::max_element(maxima.begin() + firstColumn, maxima.begin() + endColumn);
+        return { lowest, highest };
+    }
+
+private:
+    static constexpr int maxRunFromDisk = 4096;
+
+    int getColumnStart(int column) const { return (int) ((juce::int64) numSamples * column / numColumns); }
+
+    std::vector<float> minima, maxima;
+    int numSamples = 0;
+};
+
+//==============================================================================
+/**
+ * Pitch index over the trimmed capture holding, for each note, double
+ * precision prefix sums of its weight and cents moment at the frames where
+ * they change. The statistics for any sample range come from two binary
+ * searches per note that occurs at all, exactly up to rounding however long
+ * the capture. Storage is one entry per voiced frame, which keeps the index
+ * over an hour from disk to a few megabytes.
+ * Frame i covers samples [firstFrameOffset + i * hopSize, + windowSize).
+ */
+class PitchNoteIndex
+{
+public:
+    void build(const std::vector<PitchStatistics::Frame>& frames, int newFirstFrameOffset, int newHopSize, int newWindowSize)
+    {
+        firstFrameOffset = newFirstFrameOffset;
+        hopSize = newHopSize;
+        windowSize = newWindowSize;
+        numFrames = (int) frames.size();
+
+        for (auto& sums : prefixSums)
+            sums.clear();
+
+        for (int frame = 0; frame < numFrames; ++frame)
+        {
+            const auto& data = frames[(size_t) frame];
+
+            if (data.note < 0 || data.note >= PitchStatistics::numNotes)
+                continue;
+
+            auto& sums = prefixSums[(size_t) data.note];
+            const auto previous = sums.empty() ? PrefixSum() : sums.back();
+            sums.push_back({ frame + 1, previous.weight + data.weight, previous.centsMoment + (double) data.weight * data.cents });
+        }
+    }
+
+    void clear()
+    {
+        for (auto& sums : prefixSums)
+            sums.clear();
+
+        numFrames = 0;
+    }
+
+    /** Statistics of the frames lying entirely inside [startSample, endSample) */
+    void getStatistics(int startSample, int endSample, PitchStatistics& statistics) const
+    {
+        statistics.clear();
+
+        if (numFrames == 0 || hopSize <= 0)
+            return;
+
+        const int firstFrame = juce::jmax(0, ceilDiv(startSample - firstFrameOffset, hopSize));
+        const int lastFrame = juce::jmin(numFrames - 1, floorDiv(endSample - windowSize - firstFrameOffset, hopSize));
+
+        if (lastFrame < firstFrame)
+            return;
+
+        for (int note = 0; note < PitchStatistics::numNotes; ++note)
+        {
+            const auto& sums = prefixSums[(size_t) note];
+
+            if (sums.empty())
+                continue;
+
+            const auto upper = prefixBefore(sums, lastFrame + 1);
+            const auto lower = prefixBefore(sums, firstFrame);
+            statistics.setNote(note, upper.weight - lower.weight, upper.centsMoment - lower.centsMoment);
+        }
+    }
+
+    int getNumFrames() const { return numFrames; }
+
+private:
+    /** A note's totals over frames [0, endFrame) */
+    struct PrefixSum
+    {
+        int endFrame = 0;
+        double weight = 0.0;
+        double centsMoment = 0.0;
+    };
+
+    static int floorDiv(int a, int b) { return a >= 0 ? a / b : -((-a + b - 1) / b); }
+    static int ceilDiv(int a, int b) { return -floorDiv(-a, b); }
+
+    /** The note's totals over frames [0, frame), from the last change at or before it */
+    static PrefixSum prefixBefore(const std::vector<PrefixSum>& sums, int frame)
+    {
+        const auto next = std::upper_bound(sums.begin(), sums.end(), frame,
+                                           [] (int value, const PrefixSum& sum) { return value < sum.endFrame; });
+
+        return next == sums.begin() ? PrefixSum() : *(next - 1);
+    }
+
+    std::array<std::vector<PrefixSum>, PitchStatistics::numNotes> prefixSums; // One entry per frame on the note
+    int firstFrameOffset = 0;
+    int hopSize = 0;
+    int windowSize = 0;
+    int numFrames = 0;
+};
+
+//==============================================================================
+/**
+ * Worker pool for analysis jobs that split into independent items. Each worker
+ * starts with an equal contiguous range of items; a worker that runs dry steals
+ * the upper half of the largest remaining range. The calling thread acts as
+ * worker 0. Plugin instances share one pool through juce::SharedResourcePointer.
+ */
+class AnalysisThreadPool
+{
+public:
+    AnalysisThreadPool()
+        : AnalysisThreadPool((int) std::thread::hardware_concurrency())
+    {
+    }
+
+    explicit AnalysisThreadPool(int numThreads)
+        : numWorkers(juce::jmax(1, numThreads)),
+          ranges(new WorkRange[(size_t) numWorkers])
+    {
+        for (int i = 1; i < numWorkers; ++i)
+            threads.emplace_back([this, i] { workerLoop(i); });
+    }
+
+    ~AnalysisThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            shuttingDown = true;
+        }
+        wake.notify_all();
+
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    int getNumWorkers() const { return numWorkers; }
+
+    /** Called as body(workerIndex, item); workerIndex is in [0, getNumWorkers()) */
+    using Body = std::function<void(int, int)>;
+
+    /** Runs body for every item in [0, numItems) and returns once all of them are done */
+    void parallelFor(int numItems, const Body& body)
+    {
+        if (numItems <= 0)
+            return;
+
+        // One job at a time; other callers queue up here
+        std::lock_guard<std::mutex> jobLock(jobMutex);
+        runJob(numItems, body);
+    }
+
+    /** Like parallelFor, but returns false without running anything if another job has the pool */
+    bool tryParallelFor(int numItems, const Body& body)
+    {
+        std::unique_lock<std::mutex> jobLock(jobMutex, std::try_to_lock);
+
+        if (! jobLock.owns_lock())
+            return false;
+
+        if (numItems > 0)
+            runJob(numItems, body);
+
+        return true;
+    }
+
+private:
+    struct WorkRange
+    {
+        std::mutex lock;
+        int next = 0;
+        int end = 0;
+    };
+
+    /** Caller holds jobMutex */
+    void runJob(int numItems, const Body& body)
+    {
+        for (int worker = 0; worker < numWorkers; ++worker)
+        {
+            std::lock_guard<std::mutex> lock(ranges[worker].lock);
+            ranges[worker].next = (int) ((juce::int64) numItems * worker / numWorkers);
+            ranges[worker].end = (int) ((juce::int64) numItems * (worker + 1) / numWorkers);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            currentBody = &body;
+            busyHelpers = numWorkers - 1;
+            ++generation;
+        }
+        wake.notify_all();
+
+        runItems(0);
+
+        // Helpers must all have finished before body goes out of scope
+        std::unique_lock<std::mutex> lock(stateMutex);
+        finished.wait(lock, [this] { return busyHelpers == 0; });
+        currentBody = nullptr;
+    }
+
+    void workerLoop(int workerIndex)
+    {
+        juce::uint64 seenGeneration = 0;
+
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(stateMutex);
+                wake.wait(lock, [&] { return shuttingDown || generation != seenGeneration; });
+
+                if (shuttingDown)
+                    return;
+
+                seenGeneration = generation;
+            }
+
+            runItems(workerIndex);
+
+            {
+                std::lock_guard<std::mutex> lock(stateMutex);
+                --busyHelpers;
+            }
+            finished.notify_all();
+        }
+    }
+
+    void runItems(int workerIndex)
+    {
+        int item = 0;
+
+        while (takeItem(workerIndex, item) || (stealRange(workerIndex) && takeItem(workerIndex, item)))
+            (*currentBody)(workerIndex, item);
+    }
+
+    bool takeItem(int workerIndex, int& item)
+    {
+        auto& range = ranges[workerIndex];
+        std::lock_guard<std::mutex> lock(range.lock);
+
+        if (range.next >= range.end)
+            return false;
+
+        item = range.next++;
+        return true;
+    }
+
+    bool stealRange(int thief)
+    {
+        for (;;)
+        {
+            // Find the worker with the most items left
+            int victim = -1;
+            int largest = 0;
+
+            for (int worker = 0; worker < numWorkers; ++worker)
+            {
+                if (worker == thief)
+                    continue;
+
+                std::lock_guard<std::mutex> lock(ranges[worker].lock);
+                const int remaining = ranges[worker].end - ranges[worker].next;
+
+                if (remaining > largest)
+                {
+                    largest = remaining;
+                    victim = worker;
+                }
+            }
+
+            if (victim < 0)
+                return false;
+
+            int stolenBegin = 0, stolenEnd = 0;
+            {
+                auto& range = ranges[victim];
+                std::lock_guard<std::mutex> lock(range.lock);
+                const int remaining = range.end - range.next;
+
+                // Someone else got there first, look again
+                if (remaining <= 0)
+                    continue;
+
+                stolenEnd = range.end;
+                stolenBegin = range.next + remaining / 2;
+                range.end = stolenBegin;
+            }
+
+            // Only ever hold one range lock at a time, so thieves can't deadlock each other
+            std::lock_guard<std::mutex> lock(ranges[thief].lock);
+            ranges[thief].next = stolenBegin;
+            ranges[thief].end = stolenEnd;
+            return true;
+        }
+    }
+
+    const int numWorkers;
+    std::unique_ptr<WorkRange[]> ranges;
+    std::vector<std::thread> threads;
+
+    std::mutex jobMutex;
+    std::mutex stateMutex;
+    std::condition_variable wake, finished;
+    const Body* currentBody = nullptr;
+    juce::uint64 generation = 0;
+    int busyHelpers = 0;
+    bool shuttingDown = false;
+};
+
+//==============================================================================
+/**
+ * Lossless codec for one channel of recorded audio, in the manner of FLAC.
+ * The samples are coded in blocks of blockSize, each as one of:
+ *   - constant: a single value, for digital silence and DC;
+ *   - predicted: when every sample is a whole multiple of 2^-23, as anything
+ *     from a 16 or 24 bit converter or file is, the samples as integers less
+ *     the low bits they all leave at zero, predicted from the previous few by
+ *     quantised linear prediction; the residual is Rice coded in partitions
+ *     that each pick their own parameter, and the sign of each zero follows
+ *     if any of them is negative;
+ *   - verbatim: the float bits, for everything else.
+ * Prediction runs in 64-bit integers, so decoding restores every bit.
+ */
+class LosslessAudioCodec
+{
+public:
+    static constexpr int blockSize = 4096;
+
+    /** Appends the coded samples to dest */
+    static void encode(const float* samples, int numSamples, std::vector<juce::uint8>& dest)
+    {
+        BitWriter writer(dest);
+        std::vector<juce::int32> integers((size_t) blockSize);
+        std::vector<juce::int32> residual((size_t) blockSize);
+
+        for (int start = 0; start < numSamples; start += blockSize)
+            encodeBlock(samples + start, juce::jmin(blockSize, numSamples - start), writer, integers.data(), residual.data());
+
+        writer.flush();
+    }
+
+    /** Most bytes encode() can append for numSamples samples: every block verbatim */
+    static size_t getMaxEncodedSize(int numSamples)
+    {
+        const int numBlocks = (numSamples + blockSize - 1) / blockSize;
+        return ((size_t) numBlocks * 2 + (size_t) numSamples * 32 + 7) / 8;
+    }
+
+    /** Decodes numSamples samples, as many as were encoded */
+    static void decode(const juce::uint8* data, size_t size, float* samples, int numSamples)
+    {
+        BitReader reader(data, size);
+        std::vector<juce::int32> integers((size_t) blockSize);
+
+        for (int start = 0; start < numSamples; start += blockSize)
+            decodeBlock(reader, samples + start, juce::jmin(blockSize, numSamples - start), integers.data());
+    }
+
+private:
+    enum BlockType { constantBlock, verbatimBlock, predictedBlock };
+
+    static constexpr int maxOrder = 8;
+    static constexpr int coefficientBits = 14;
+    static constexpr int partitionSize = 256;
+    static constexpr int escapeParameter = 31; // Partition stored as raw 32-bit values
+    static constexpr double integerScale = 8388608.0; // 2^23
+    static constexpr double maxInteger = 1073741824.0; // 2^30, leaving the residual headroom
+
+    class BitWriter
+    {
+    public:
+        explicit BitWriter(std::vector<juce::uint8>& destination) : dest(destination) {}
+
+        /** Writes the low numBits (at most 32) bits of value */
+        void write(juce::uint32 value, int numBits)
+        {
+            accumulator = (accumulator << numBits) | (value & (((juce::uint64) 1 << numBits) - 1));
+            pending += numBits;
+
+            while (pending >= 8)
+            {
+                pending -= 8;
+                dest.push_back((juce::uint8) (accumulator >> pending));
+            }
+        }
+
+        /** count zeros, then a one */
+        void writeUnary(juce::uint32 count)
+        {
+            for (; count >= 32; count -= 32)
+                write(0, 32);
+
+            write(1, (int) count + 1);
+        }
+
+        void flush()
+        {
+            if (pending > 0)
+                write(0, 8 - pending);
+        }
+
+    private:
+        std::vector<juce::uint8>& dest;
+        juce::uint64 accumulator = 0;
+        int pending = 0; // Bits in the accumulator not yet written out
+    };
+
+    class BitReader
+    {
+    public:
+        BitReader(const juce::uint8* source, size_t sourceSize) : data(source), size(sourceSize) {}
+
+        juce::uint32 read(int numBits)
+        {
+            while (available < numBits)
+                refill();
+
+            available -= numBits;
+            return (juce::uint32) ((accumulator >> available) & (((juce::uint64) 1 << numBits) - 1));
+        }
+
+        /** Counts zeros up to the next one, and skips past it */
+        juce::uint32 readUnary()
+        {
+            juce::uint32 count = 0;
+
+            for (;;)
+            {
+                while (available <= 24)
+                    refill();
+
+                const auto bits = (juce::uint32) (accumulator & (((juce::uint64) 1 << available) - 1));
+
+                if (bits != 0)
+                {
+                    const int zeros = available - 1 - juce::findHighestSetBit(bits);
+                    available -= zeros + 1;
+                    return count + (juce::uint32) zeros;
+                }
+
+                count += (juce::uint32) available;
+                available = 0;
+            }
+        }
+
+    private:
+        void refill()
+        {
+            accumulator = (accumulator << 8) | (position < size ? data[position] : 0);
+            ++position;
+            available += 8;
+        }
+
+        const juce::uint8* data;
+        size_t size;
+        size_t position = 0;
+        juce::uint64 accumulator = 0;
+        int available = 0; // Bits read in but not yet consumed
+    };
+
+    static juce::uint32 floatBits(float value)
+    {
+        juce::uint32 bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    static float floatFromBits(juce::uint32 bits)
+    {
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    static juce::uint32 zigzag(juce::int32 value) { return ((juce::uint32) value << 1) ^ (juce::uint32) (value >> 31); }
+    static juce::int32 unzigzag(juce::uint32 value) { return (juce::int32) (value >> 1) ^ -(juce::int32) (value & 1); }
+
+    /** Quantised predictor: x[i] is predicted as (sum of coefficients[j] * x[i - 1 - j]) >> shift */
+    struct Predictor
+    {
+        int order = 0;
+        int shift = 0;
+        std::array<juce::int32, maxOrder> coefficients {};
+
+        juce::int64 predict(const juce::int32* history) const
+        {
+            juce::int64 sum = 0;
+            for (int j = 0; j < order; ++j)
+                sum += (juce::int64) coefficients[(size_t) j] * history[-1 - j];
+
+            return sum >> shift;
+        }
+    };
+
+    static void encodeBlock(const float* samples, int numSamples, BitWriter& writer, juce::int32* integers, juce::int32* residual)
+    {
+        // Step 1: Constant blocks
+        const juce::uint32 firstBits = floatBits(samples[0]);
+        bool isConstant = true;
+
+        for (int i = 1; i < numSamples && isConstant; ++i)
+            isConstant = floatBits(samples[i]) == firstBits;
+
+        if (isConstant)
+        {
+            writer.write(constantBlock, 2);
+            writer.write(firstBits, 32);
+            return;
+        }
+
+        // Step 2: Samples that are exact integers at 24 bits, less the low bits none of them use
+        bool hasNegativeZeros = false;
+
+        if (toIntegers(samples, numSamples, integers, hasNegativeZeros))
+        {
+            juce::uint32 usedBits = 0;
+            for (int i = 0; i < numSamples; ++i)
+                usedBits |= (juce::uint32) integers[i];
+
+            // A block of nothing but zeros of either sign has no bits to strip
+            const int wastedBits = usedBits != 0 ? juce::countNumberOfBits((usedBits & (0u - usedBits)) - 1) : 0;
+
+            for (int i = 0; i < numSamples; ++i)
+                integers[i] >>= wastedBits;
+
+            // Step 3: Predict, and keep the result if it beats the raw floats
+            const auto predictor = findPredictor(integers, numSamples);
+
+            if (computeResidual(predictor, integers, numSamples, residual))
+            {
+                int headerBits = 2 + 5 + 1 + 4 + (predictor.order > 0 ? 5 + predictor.order * (coefficientBits + 32) : 0);
+
+                if (hasNegativeZeros)
+                    headerBits += (int) std::count(integers, integers + numSamples, 0);
+
+                if (headerBits + codeResidual(residual, predictor.order, numSamples, nullptr) < (juce::int64) numSamples * 32)
+                {
+                    writer.write(predictedBlock, 2);
+                    writer.write((juce::uint32) wastedBits, 5);
+                    writer.write(hasNegativeZeros ? 1 : 0, 1);
+                    writer.write((juce::uint32) predictor.order, 4);
+
+                    if (predictor.order > 0)
+                    {
+                        writer.write((juce::uint32) predictor.shift, 5);
+
+                        for (int j = 0; j < predictor.order; ++j)
+                            writer.write((juce::uint32) predictor.coefficients[(size_t) j], coefficientBits);
+
+                        for (int i = 0; i < predictor.order; ++i)
+                            writer.write((juce::uint32) integers[i], 32);
+                    }
+
+                    codeResidual(residual, predictor.order, numSamples, &writer);
+
+                    if (hasNegativeZeros)
+                        for (int i = 0; i < numSamples; ++i)
+                            if (integers[i] == 0)
+                                writer.write(std::signbit(samples[i]) ? 1 : 0, 1);
+
+                    return;
+                }
+            }
+        }
+
+        // Step 4: Anything else goes as it is
+        writer.write(verbatimBlock, 2);
+
+        for (int i = 0; i < numSamples; ++i)
+            writer.write(floatBits(samples[i]), 32);
+    }
+
+    static void decodeBlock(BitReader& reader, float* samples, int numSamples, juce::int32* integers)
+    {
+        const auto type = (int) reader.read(2);
+
+        if (type == constantBlock)
+        {
+            std::fill(samples, samples + numSamples, floatFromBits(reader.read(32)));
+            return;
+        }
+
+        if (type == verbatimBlock)
+        {
+            for (int i = 0; i < numSamples; ++i)
+                samples[i] = floatFromBits(reader.read(32));
+
+            return;
+        }
+
+        const int wastedBits = (int) reader.read(5);
+        const bool hasNegativeZeros = reader.read(1) != 0;
+        Predictor predictor;
+        predictor.order = (int) reader.read(4);
+
+        if (predictor.order > 0)
+        {
+            predictor.shift = (int) reader.read(5);
+
+            // Coefficients are stored as signed coefficientBits-bit values
+            for (int j = 0; j < predictor.order; ++j)
+                predictor.coefficients[(size_t) j] = (juce::int32) (reader.read(coefficientBits) << (32 - coefficientBits)) >> (32 - coefficientBits);
+
+            for (int i = 0; i < predictor.order; ++i)
+                integers[i] = (juce::int32) reader.read(32);
+        }
+
+        // Residual partitions, each with its own Rice parameter
+        for (int partitionStart = 0; partitionStart < numSamples; partitionStart += partitionSize)
+        {
+            const int first = juce::jmax(partitionStart, predictor.order);
+            const int end = juce::jmin(numSamples, partitionStart + partitionSize);
+
+            if (first >= end)
+                continue;
+
+            const int parameter = (int) reader.read(5);
+
+            for (int i = first; i < end; ++i)
+            {
+                juce::uint32 value;
+
+                if (parameter == escapeParameter)
+                    value = reader.read(32);
+                else
+                    value = (reader.readUnary() << parameter) | (parameter > 0 ? reader.read(parameter) : 0);
+
+                integers[i] = (juce::int32) (unzigzag(value) + predictor.predict(integers + i));
+            }
+        }
+
+        for (int i = 0; i < numSamples; ++i)
+            samples[i] = (float) ((double) integers[i] * (double) ((juce::int64) 1 << wastedBits) / integerScale);
+
+        if (hasNegativeZeros)
+            for (int i = 0; i < numSamples; ++i)
+                if (integers[i] == 0 && reader.read(1) != 0)
+                    samples[i] = -0.0f;
+    }
+
+    /** False unless every sample is an exact multiple of 2^-23 within range; negative zeros become 0 and are flagged */
+    static bool toIntegers(const float* samples, int numSamples, juce::int32* integers, bool& hasNegativeZeros)
+    {
+        for (int i = 0; i < numSamples; ++i)
+        {
+            const double scaled = (double) samples[i] * integerScale;
+
+            if (! (std::abs(scaled) < maxInteger) || scaled != std::floor(scaled))
+                return false;
+
+            integers[i] = (juce::int32) scaled;
+            hasNegativeZeros = hasNegativeZeros || (samples[i] == 0.0f && std::signbit(samples[i]));
+        }
+
+        return true;
+    }
+
+    /** Linear prediction from the windowed autocorrelation, with the order picked by estimated coded size */
+    static Predictor findPredictor(const juce::int32* integers, int numSamples)
+    {
+        Predictor predictor;
+        const int maxUsableOrder = juce::jmin(maxOrder, numSamples / 16);
+
+        if (maxUsableOrder <= 0)
+            return predictor;
+
+        // Step 1: Autocorrelation under a Tukey window, tapering a quarter at each end
+        std::array<double, maxOrder + 1> autocorrelation {};
+        std::vector<double> windowed((size_t) numSamples);
+        const int taper = juce::jmax(1, numSamples / 4);
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            const int fromEdge = juce::jmin(i, numSamples - 1 - i);
+            const double weight = fromEdge >= taper ? 1.0 : 0.5 - 0.5 * std::cos(juce::MathConstants<double>::pi * fromEdge / taper);
+            windowed[(size_t) i] = integers[i] * weight;
+        }
+
+        for (int lag = 0; lag <= maxUsableOrder; ++lag)
+            for (int i = lag; i < numSamples; ++i)
+                autocorrelation[(size_t) lag] += windowed[(size_t) i] * windowed[(size_t) (i - lag)];
+
+        if (autocorrelation[0] <= 0.0)
+            return predictor;
+
+        // Step 2: Levinson-Durbin, keeping the order whose residual should code smallest
+        std::array<double, maxOrder> coefficients {}, best {};
+        double error = autocorrelation[0];
+        double bestBits = 0.5 * std::log2(error) * numSamples;
+        int bestOrder = 0;
+
+        for (int order = 1; order <= maxUsableOrder; ++order)
+        {
+            double reflection = autocorrelation[(size_t) order];
+            for (int j = 0; j < order - 1; ++j)
+                reflection -= coefficients[(size_t) j] * autocorrelation[(size_t) (order - 1 - j)];
+            reflection /= error;
+
+            auto previous = coefficients;
+            coefficients[(size_t) (order - 1)] = reflection;
+            for (int j = 0; j < order - 1; ++j)
+                coefficients[(size_t) j] = previous[(size_t) j] - reflection * previous[(size_t) (order - 2 - j)];
+
+            error *= 1.0 - reflection * reflection;
+
+            if (error <= 0.0)
+                break;
+
+            const double bits = 0.5 * std::log2(error) * (numSamples - order) + order * (coefficientBits + 32);
+
+            if (bits < bestBits)
+            {
+                bestBits = bits;
+                bestOrder = order;
+                best = coefficients;
+            }
+        }
+
+        if (bestOrder == 0)
+            return predictor;
+
+        // Step 3: Quantise to coefficientBits, carrying each rounding error into the next coefficient
+        double largest = 0.0;
+        for (int j = 0; j < bestOrder; ++j)
+            largest = juce::jmax(largest, std::abs(best[(size_t) j]));
+
+        int exponent = 0;
+        std::frexp(largest, &exponent);
+        const int shift = juce::jmin(31, coefficientBits - 1 - exponent);
+
+        if (shift < 0)
+            return predictor;
+
+        const int limit = 1 << (coefficientBits - 1);
+        double carried = 0.0;
+
+        for (int j = 0; j < bestOrder; ++j)
+        {
+            carried += best[(size_t) j] * (double) ((juce::int64) 1 << shift);
+            const auto quantised = juce::jlimit(-limit, limit - 1, (int) std::lround(carried));
+            predictor.coefficients[(size_t) j] = quantised;
+            carried -= quantised;
+        }
+
+        predictor.order = bestOrder;
+        predictor.shift = shift;
+        return predictor;
+    }
+
+    /** False if any residual is too large to code */
+    static bool computeResidual(const Predictor& predictor, const juce::int32* integers, int numSamples, juce::int32* residual)
+    {
+        for (int i = predictor.order; i < numSamples; ++i)
+        {
+            const juce::int64 value = integers[i] - predictor.predict(integers + i);
+
+            if (value <= -(juce::int64) maxInteger || value >= (juce::int64) maxInteger)
+                return false;
+
+            residual[i] = (juce::int32) value;
+        }
+
+        return true;
+    }
+
+    /** Size in bits of the Rice coded residual; also writes it, given a writer */
+    static juce::int64 codeResidual(const juce::int32* residual, int order, int numSamples, BitWriter* writer)
+    {
+        juce::int64 totalBits = 0;
+
+        for (int partitionStart = 0; partitionStart < numSamples; partitionStart += partitionSize)
+        {
+            const int first = juce::jmax(partitionStart, order);
+            const int end = juce::jmin(numSamples, partitionStart + partitionSize);
+
+            if (first >= end)
+                continue;
+
+            // Try the parameters either side of the one the mean suggests, and the escape
+            juce::uint64 sum = 0;
+            for (int i = first; i < end; ++i)
+                sum += zigzag(residual[i]);
+
+            const auto mean = (juce::uint32) (sum / (juce::uint64) (end - first));
+            const int suggested = mean > 0 ? juce::findHighestSetBit(mean) : 0;
+
+            int parameter = escapeParameter;
+            juce::int64 partitionBits = (juce::int64) (end - first) * 32;
+
+            for (int candidate = juce::jmax(0, suggested - 1); candidate <= juce::jmin(30, suggested + 1); ++candidate)
+            {
+                juce::int64 bits = (juce::int64) (end - first) * (candidate + 1);
+                for (int i = first; i < end; ++i)
+                    bits += zigzag(residual[i]) >> candidate;
+
+                if (bits < partitionBits)
+                {
+                    partitionBits = bits;
+                    parameter = candidate;
+                }
+            }
+
+            totalBits += 5 + partitionBits;
+
+            if (writer == nullptr)
+                continue;
+
+            writer->write((juce::uint32) parameter, 5);
+
+            for (int i = first; i < end; ++i)
+            {
+                const juce::uint32 value = zigzag(residual[i]);
+
+                if (parameter == escapeParameter)
+                {
+                    writer->write(value, 32);
+                }
+                else
+                {
+                    writer->writeUnary(value >> parameter);
+
+                    if (parameter > 0)
+                        writer->write(value, parameter);
+                }
+            }
+        }
+
+        return totalBits;
+    }
+};
+
+//==============================================================================
+/**
+ * Older recording history kept in RAM, losslessly compressed, so the same
+ * memory reaches further back than raw samples would. A background thread
+ * follows the ring and compresses each segment with LosslessAudioCodec once
+ * it is compactAfter samples old; the rest of the ring is slack for the
+ * thread to keep up. The oldest compressed segments go once the store is
+ * over its byte budget or its span. Captures decode the part before the ring
+ * on demand, one item per segment and channel across the shared analysis
+ * pool, into a buffer of their own, and take the newest whole segments from
+ * the ring as usual. Segments the ring lapped before they could be
+ * compressed read back as silence.
+ */
+class CompressedHistory : private juce::Thread
+{
+public:
+    /**
+     * Reaches at most maxSpanInSamples back. The byte budget is what guaranteedSpanInSamples
+     * takes when nothing compresses, so captures always reach at least that far; compressible
+     * audio goes further in the same memory.
+     */
+    CompressedHistory(CircularAudioBuffer& ringToFollow, int compactAfterSamples, juce::int64 guaranteedSpanInSamples, juce::int64 maxSpanInSamples)
+        : juce::Thread("Compressed history"),
+          ring(ringToFollow),
+          compactAfter(juce::jmin(compactAfterSamples, ringToFollow.getSize() - AudioSegment::size)),
+          budget(getBudgetFor(guaranteedSpanInSamples, compactAfter, ringToFollow.getNumChannels())),
+          maxSpan(juce::jmax(maxSpanInSamples, guaranteedSpanInSamples, (juce::int64) ringToFollow.getSize()))
+    {
+        nextSegment = juce::jmax((juce::int64) 0, AudioSegment::indexOf(ring.getTotalSamplesWritten() - ring.getSize()) + 1);
+        firstStoredSegment = nextSegment;
+        startThread();
+    }
+
+    ~CompressedHistory() override
+    {
+        stopThread(5000);
+    }
+
+    /** Longest capture available now, in samples: back to the oldest compressed segment, and at least the ring */
+    juce::int64 getCapacity() const
+    {
+        std::lock_guard<std::mutex> lock(storeLock);
+
+        if (store.empty())
+            return ring.getSize();
+
+        const juce::int64 reach = ring.getTotalSamplesWritten() - firstStoredSegment * AudioSegment::size;
+        return juce::jlimit((juce::int64) ring.getSize(), maxSpan, reach);
+    }
+
+    /** Upper bound of getCapacity() */
+    juce::int64 getMaxCapacity() const { return maxSpan; }
+
+    /** Compressed bytes held */
+    size_t getStoredBytes() const
+    {
+        std::lock_guard<std::mutex> lock(storeLock);
+        return storedBytes;
+    }
+
+    /** Absolute position up to which the compactor has gone through the ring's segments */
+    juce::int64 getStoredEnd() const { return storedEnd.load(std::memory_order_acquire); }
+
+    /** Freezes the most recent numSamples samples, decoding the part before the ring's whole segments */
+    AudioCapture freezeLatest(int numSamples)
+    {
+        if (numSamples <= ring.getSize())
+            return ring.freezeLatest(numSamples);
+
+        jassert(numSamples <= maxSpan);
+
+        // Retried like CircularAudioBuffer::freezeLatest() while the audio thread moves the ring on
+        for (int attempt = 0; attempt < maxFreezeAttempts; ++attempt)
+        {
+            const juce::int64 total = ring.getTotalSamplesWritten();
+            const juce::int64 absoluteStart = total - numSamples;
+            const juce::int64 ringStart = (AudioSegment::indexOf(total - ring.getSize()) + 1) * AudioSegment::size;
+            const auto tail = ring.freeze(ringStart, (int) (total - ringStart));
+
+            if (tail.getNumSamples() > 0)
+                return AudioCapture::concatenate(decode(absoluteStart, (int) (ringStart - absoluteStart)), tail);
+        }
+
+        jassertfalse;
+        return {};
+    }
+
+private:
+    /** One segment, coded channel by channel */
+    struct CompressedSegment
+    {
+        std::vector<std::vector<juce::uint8>> channels;
+    };
+
+    using SegmentPtr = std::shared_ptr<const CompressedSegment>;
+
+    static constexpr int maxFreezeAttempts = 8;
+
+    /**
+     * Bytes for the stored segments to cover span less the compactAfter samples still only in
+     * the ring, at the codec's largest output, plus a segment each for the partly covered one at
+     * the start and one the compactor is still working on.
+     */
+    static size_t getBudgetFor(juce::int64 span, int compactAfter, int numChannels)
+    {
+        const juce::int64 numSegments = (juce::jmax((juce::int64) 0, span - compactAfter) + AudioSegment::size - 1) / AudioSegment::size + 2;
+        return (size_t) numSegments * (size_t) numChannels * LosslessAudioCodec::getMaxEncodedSize(AudioSegment::size);
+    }
+
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            compressOldSegments();
+            wait(50);
+        }
+    }
+
+    /** Compresses every segment that has become compactAfter samples old since the last pass */
+    void compressOldSegments()
+    {
+        const juce::int64 total = ring.getTotalSamplesWritten();
+        const juce::int64 endSegment = AudioSegment::indexOf(total - compactAfter);
+        const juce::int64 oldestInRing = AudioSegment::indexOf(total - ring.getSize()) + 1;
+
+        // After a long stall only the span that can be kept is worth going through
+        nextSegment = juce::jmax(nextSegment, endSegment - maxSpan / AudioSegment::size);
+
+        for (; nextSegment < endSegment && ! threadShouldExit(); ++nextSegment)
+        {
+            SegmentPtr compressed;
+
+            if (nextSegment >= oldestInRing)
+            {
+                const auto segment = ring.freeze(nextSegment * AudioSegment::size, AudioSegment::size);
+
+                if (segment.getNumSamples() > 0)
+                    compressed = compress(segment);
+            }
+
+            append(nextSegment, std::move(compressed));
+        }
+
+        storedEnd.store(nextSegment * AudioSegment::size, std::memory_order_release);
+    }
+
+    SegmentPtr compress(const AudioCapture& segment)
+    {
+        auto compressed = std::make_shared<CompressedSegment>();
+        compressed->channels.resize((size_t) segment.getNumChannels());
+
+        for (int channel = 0; channel < segment.getNumChannels(); ++channel)
+        {
+            // Coded into reused space first, so each stored block is allocated at its final size
+            codedScratch.clear();
+            LosslessAudioCodec::encode(segment.getReadPointer(channel, 0, AudioSegment::size, nullptr), AudioSegment::size, codedScratch);
+            compressed->channels[(size_t) channel].assign(codedScratch.begin(), codedScratch.end());
+        }
+
+        return compressed;
+    }
+
+    /** Adds segment index to the store (nullptr if it was lost), then trims the oldest to the budget and span */
+    void append(juce::int64 index, SegmentPtr compressed)
+    {
+        std::lock_guard<std::mutex> lock(storeLock);
+
+        // Anything lost in between reads as silence
+        if (store.empty())
+            firstStoredSegment = index;
+
+        while (firstStoredSegment + (juce::int64) store.size() < index)
+            store.push_back(nullptr);
+
+        storedBytes += getSize(compressed);
+        store.push_back(std::move(compressed));
+
+        while (! store.empty() && (storedBytes > budget || (juce::int64) store.size() * AudioSegment::size > maxSpan))
+        {
+            storedBytes -= getSize(store.front());
+            store.pop_front();
+            ++firstStoredSegment;
+        }
+    }
+
+    static size_t getSize(const SegmentPtr& compressed)
+    {
+        size_t bytes = 0;
+
+        if (compressed != nullptr)
+            for (auto& channel : compressed->channels)
+                bytes += channel.size();
+
+        return bytes;
+    }
+
+    /** Decodes whole segments from absoluteStart, length samples long, into a buffer the capture owns */
+    AudioCapture decode(juce::int64 absoluteStart, int length)
+    {
+        const juce::int64 firstSegment = AudioSegment::indexOf(absoluteStart);
+        const int numSegments = (int) (AudioSegment::indexOf(absoluteStart + length - 1) + 1 - firstSegment);
+        const int numChannels = ring.getNumChannels();
+
+        // Step 1: Take the compressed segments out of the store, so the compactor can carry on meanwhile
+        std::vector<SegmentPtr> segments((size_t) numSegments);
+        {
+            std::lock_guard<std::mutex> lock(storeLock);
+
+            for (int i = 0; i < numSegments; ++i)
+            {
+                const juce::int64 position = firstSegment + i - firstStoredSegment;
+
+                if (position >= 0 && position < (juce::int64) store.size())
+                    segments[(size_t) i] = store[(size_t) position];
+            }
+        }
+
+        // Step 2: Decode segment by segment and channel by channel, across the pool
+        auto buffer = std::make_shared<juce::AudioBuffer<float>>(numChannels, numSegments * AudioSegment::size);
+        float* const* channels = buffer->getArrayOfWritePointers();
+
+        const AnalysisThreadPool::Body decodeItem = [&] (int, int item)
+        {
+            const auto& segment = segments[(size_t) (item / numChannels)];
+            const int channel = item % numChannels;
+            float* dest = channels[channel] + (item / numChannels) * AudioSegment::size;
+
+            if (segment == nullptr || channel >= (int) segment->channels.size())
+            {
+                std::fill(dest, dest + AudioSegment::size, 0.0f);
+                return;
+            }
+
+            const auto& coded = segment->channels[(size_t) channel];
+            LosslessAudioCodec::decode(coded.data(), coded.size(), dest, AudioSegment::size);
+        };
+
+        // The pool runs one job at a time for every instance; rather than wait behind another's
+        // analysis of a whole take, decode on this thread, which is bounded by the capture's length
+        if (! pool->tryParallelFor(numSegments * numChannels, decodeItem))
+            for (int item = 0; item < numSegments * numChannels; ++item)
+                decodeItem(0, item);
+
+        std::vector<const float*> channelData;
+        for (int segment = 0; segment < numSegments; ++segment)
+            for (int channel = 0; channel < numChannels; ++channel)
+                channelData.push_back(channels[channel] + segment * AudioSegment::size);
+
+        return AudioCapture(std::move(channelData), std::move(buffer), absoluteStart,
+                            (int) (absoluteStart - firstSegment * AudioSegment::size), length, numChannels);
+    }
+
+    CircularAudioBuffer& ring;
+    const int compactAfter;
+    const size_t budget;
+    const juce::int64 maxSpan;
+    juce::SharedResourcePointer<AnalysisThreadPool> pool;
+
+    // Written by the compactor, read by captures, under storeLock
+    mutable std::mutex storeLock;
+    std::deque<SegmentPtr> store; // Segment firstStoredSegment + i at store[i]; nullptr for lost ones
+    juce::int64 firstStoredSegment = 0;
+    size_t storedBytes = 0;
+
+    // Compactor thread only
+    juce::int64 nextSegment = 0;
+    std::vector<juce::uint8> codedScratch;
+
+    std::atomic<juce::int64> storedEnd { 0 };
+};
+
+//==============================================================================
+/**
+ * Splits framed pitch analysis over the shared AnalysisThreadPool, with one
+ * detector workspace per worker. Consecutive frames are handed out in runs so
+ * each worker analyses them as one batch.
+ */
+class ParallelPitchAnalyser
+{
+public:
+    void prepare(double sampleRate, const PitchAnalysisConfig& config)
+    {
+        windowSize = config.windowSize;
+        hopSize = config.hopSize;
+
+        workerDetectors.clear();
+        workerTracks.clear();
+        workerScratch.clear();
+
+        for (int i = 0; i < pool->getNumWorkers(); ++i)
+        {
+            workerDetectors.push_back(std::make_unique<DecimatingPitchDetector>(sampleRate, config));
+            workerTracks.emplace_back();
+            workerTracks.back().resize(framesPerRun);
+
+            // Both channels of a run that straddles two capture segments
+            workerScratch.emplace_back((size_t) (2 * (windowSize + (framesPerRun - 1) * hopSize)));
+        }
+    }
+
+    int getNumWorkers() const { return pool->getNumWorkers(); }
+    int getWindowSize() const { return windowSize; }
+    int getHopSize() const { return hopSize; }
+
+    /**
+     * Analyses every full window of the capture's first two channels at the
+     * configured hop. Writes each frame's note, tuning and weight to frameData
+     * and returns the statistics over all frames.
+     */
+    PitchStatistics analyseFrames(const AudioCapture& source, std::vector<PitchStatistics::Frame>& frameData)
+    {
+        const int numFrames = PitchTrack::countFrames(source.getNumSamples(), windowSize, hopSize);
+        frameData.assign((size_t) numFrames, PitchStatistics::Frame());
+
+        std::vector<int> frames((size_t) numFrames);
+        for (int frame = 0; frame < numFrames; ++frame)
+            frames[(size_t) frame] = frame;
+
+        return analyseFrameList(source, frames.data(), numFrames, frameData);
+    }
+
+    /** Analyses the listed frames only, writing frameData[frame] for each; returns their statistics */
+    PitchStatistics analyseFrameList(const AudioCapture& source, const int* frames, int numFrames,
+                                     std::vector<PitchStatistics::Frame>& frameData)
+    {
+        // Group consecutive frames into runs of at most framesPerRun
+        std::vector<std::pair<int, int>> runs;
+        for (int i = 0; i < numFrames;)
+        {
+            int length = 1;
+            while (i + length < numFrames && length < framesPerRun && frames[i + length] == frames[i] + length)
+                ++length;
+
+            runs.emplace_back(frames[i], length);
+            i += length;
+        }
+
+        std::vector<PitchStatistics> workerStatistics(workerDetectors.size());
+
+        pool->parallelFor((int) runs.size(), [&](int worker, int item)
+        {
+            auto& detector = *workerDetectors[(size_t) worker];
+            auto& track = workerTracks[(size_t) worker];
+            auto& scratch = workerScratch[(size_t) worker];
+            const int firstFrame = runs[(size_t) item].first;
+            const int length = runs[(size_t) item].second;
+
+            // Detect pitch for this run of frames in one batch, straight from the capture's segments
+            const int offset = firstFrame * hopSize;
+            const int runSamples = windowSize + (length - 1) * hopSize;
+            const float* left = source.getReadPointer(0, offset, runSamples, scratch.data());
+            const float* right = source.getNumChannels() > 1 ? source.getReadPointer(1, offset, runSamples, scratch.data() + runSamples)
+                                                             : nullptr;
+
+            detector.analyseTrack(left, right, runSamples, hopSize, track);
+
+            for (int i = 0; i < length; ++i)
+            {
+                const auto frame = PitchStatistics::Frame::fromEstimate(track.get(i));
+                frameData[(size_t) (firstFrame + i)] = frame;
+                workerStatistics[(size_t) worker].add(frame);
+            }
+        });
+
+        // One fixed-size merge per worker
+        PitchStatistics totals;
+        for (const auto& statistics : workerStatistics)
+            totals.merge(statistics);
+
+        return totals;
+    }
+
+private:
+    static constexpr int framesPerRun = 16;
+
+    juce::SharedResourcePointer<AnalysisThreadPool> pool;
+    std::vector<std::unique_ptr<DecimatingPitchDetector>> workerDetectors;
+    std::vector<PitchTrack> workerTracks;
+    std::vector<std::vector<float>> workerScratch;
+    int windowSize = 2048;
+    int hopSize = 512;
+};
+
+//==============================================================================
+/**
+ * Background pitch analysis of a capture, off the message thread.
+ * A job analyses the frames of its trim range first, publishing a running
+ * estimate after every batch, then carries on with the rest of the capture
+ * so that a complete PitchNoteIndex becomes available. Submitting a new range
+ * cancels the stale job; frames it already analysed are kept and reused.
+ * Frames use the analyser's window and hop, so they overlap.
+ */
+class PitchAnalysisService : private juce::Thread
+{
+public:
+    /** Handle to a submitted job */
+    struct Job
+    {
+        int id = 0;
+        int startSample = 0;
+        int endSample = 0;
+
+        std::atomic<bool> cancelled { false };
+        std::atomic<float> progress { 0.0f }; // Fraction of the range's frames analysed
+        std::atomic<bool> finished { false };
+
+        void cancel() { cancelled.store(true); }
+        bool isFinished() const { return finished.load(); }
+        float getProgress() const { return progress.load(); }
+    };
+
+    using JobHandle = std::shared_ptr<Job>;
+
+    /** Latest published estimate, read without locking */
+    struct Estimate
+    {
+        int jobId = 0;
+        int note = -1;        // Most common note so far, -1 if none yet
+        float fineTuneCents = 0.0f; // Tuning of that note, to the nearest cent
+        float progress = 0.0f;
+        bool complete = false;
+    };
+
+    explicit PitchAnalysisService(ParallelPitchAnalyser& analyserToUse)
+        : juce::Thread("Pitch analysis"), analyser(analyserToUse)
+    {
+        startThread();
+    }
+
+    ~PitchAnalysisService() override
+    {
+        cancelAndWait();
+        stopThread(2000);
+    }
+
+    /** Message thread: switches to a new capture, framed with the analyser's current window and hop */
+    void setSource(const AudioCapture& newSource)
+    {
+        cancelAndWait();
+
+        source = newSource;
+        numSamples = source.getNumSamples();
+        windowSize = analyser.getWindowSize();
+        hopSize = analyser.getHopSize();
+        frameData.assign((size_t) PitchTrack::countFrames(numSamples, windowSize, hopSize), notAnalysed());
+
+        std::atomic_store(&completedIndex, std::shared_ptr<const PitchNoteIndex>());
+        mailbox.store(pack({}));
+    }
+
+    /** Message thread: starts analysing [startSample, endSample), cancelling any stale job */
+    JobHandle submit(int startSample, int endSample)
+    {
+        auto job = std::make_shared<Job>();
+        job->id = ++lastJobId;
+        job->startSample = startSample;
+        job->endSample = endSample;
+
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+
+            if (runningJob != nullptr)
+                runningJob->cancel();
+
+            pendingJob = job;
+        }
+
+        notify();
+        return job;
+    }
+
+    /** Cancels pending and running jobs and waits for the worker to go idle */
+    void cancelAndWait()
+    {
+        std::unique_lock<std::mutex> lock(jobMutex);
+
+        pendingJob = nullptr;
+        if (runningJob != nullptr)
+            runningJob->cancel();
+
+        jobFinished.wait(lock, [this] { return runningJob == nullptr; });
+    }
+
+    Estimate getLatestEstimate() const { return unpack(mailbox.load(std::memory_order_acquire)); }
+
+    /** The index over the whole capture, once every frame has been analysed */
+    std::shared_ptr<const PitchNoteIndex> getCompletedIndex() const { return std::atomic_load(&completedIndex); }
+
+private:
+    static PitchStatistics::Frame notAnalysed()
+    {
+        PitchStatistics::Frame frame;
+        frame.note = -2;
+        return frame;
+    }
+
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            {
+                std::lock_guard<std::mutex> lock(jobMutex);
+                runningJob = std::move(pendingJob);
+                pendingJob = nullptr;
+            }
+
+            if (runningJob == nullptr)
+            {
+                wait(-1);
+                continue;
+            }
+
+            runJob(*runningJob);
+            runningJob->finished.store(true);
+
+            {
+                std::lock_guard<std::mutex> lock(jobMutex);
+                runningJob = nullptr;
+            }
+            jobFinished.notify_all();
+        }
+    }
+
+    void runJob(Job& job)
+    {
+        // Frames lying entirely inside [startSample, endSample)
+        const int numFrames = (int) frameData.size();
+        const int firstFrame = juce::jlimit(0, numFrames, (job.startSample + hopSize - 1) / hopSize);
+        const int lastFrame = juce::jlimit(firstFrame, numFrames, PitchTrack::countFrames(job.endSample, windowSize, hopSize));
+        const int rangeFrames = lastFrame - firstFrame;
+
+        // Gather what earlier (cancelled) jobs already analysed in this range
+        PitchStatistics rangeStatistics;
+        int analysedInRange = 0;
+
+        std::vector<int> todo;
+        todo.reserve((size_t) numFrames);
+
+        for (int frame = firstFrame; frame < lastFrame; ++frame)
+        {
+            const auto& data = frameData[(size_t) frame];
+
+            if (data.note == notAnalysed().note)
+                todo.push_back(frame);
+            else
+            {
+                ++analysedInRange;
+                rangeStatistics.add(data);
+            }
+        }
+
+        const int numRangeTodo = (int) todo.size();
+
+        // Then the rest of the capture, so the full index can be built
+        for (int frame = 0; frame < numFrames; ++frame)
+            if ((frame < firstFrame || frame >= lastFrame) && frameData[(size_t) frame].note == notAnalysed().note)
+                todo.push_back(frame);
+
+        publish(job, rangeStatistics, analysedInRange, rangeFrames);
+
+        const int batchSize = analyser.getNumWorkers() * 64;
+
+        for (int done = 0; done < (int) todo.size();)
+        {
+            if (job.cancelled.load() || threadShouldExit())
+                return;
+
+            // Keep range and out-of-range frames in separate batches
+            const int batchEnd = done < numRangeTodo ? juce::jmin(numRangeTodo, done + batchSize)
+                                                     : juce::jmin((int) todo.size(), done + batchSize);
+
+            const auto batchStatistics = analyser.analyseFrameList(source, todo.data() + done, batchEnd - done, frameData);
+
+            if (done < numRangeTodo)
+            {
+                rangeStatistics.merge(batchStatistics);
+
+                analysedInRange += batchEnd - done;
+                publish(job, rangeStatistics, analysedInRange, rangeFrames);
+            }
+
+            done = batchEnd;
+        }
+
+        // Every frame is known now
+        auto index = std::make_shared<PitchNoteIndex>();
+        index->build(frameData, 0, hopSize, windowSize);
+        std::atomic_store(&completedIndex, std::shared_ptr<const PitchNoteIndex>(std::move(index)));
+    }
+
+    void publish(Job& job, const PitchStatistics& statistics, int analysed, int total)
+    {
+        Estimate estimate;
+        estimate.jobId = job.id;
+        estimate.progress = total > 0 ? (float) analysed / (float) total : 1.0f;
+        estimate.complete = analysed >= total;
+        estimate.note = statistics.getMostCommonNote();
+        estimate.fineTuneCents = statistics.getFineTuneCents();
+
+        job.progress.store(estimate.progress);
+        mailbox.store(pack(estimate), std::memory_order_release);
+    }
+
+    // The mailbox packs an Estimate into one lock-free word:
+    // job id (32 bits) | note + 1 (8 bits) | progress in 1/1000 (16 bits) | cents + 50 (7 bits) | complete (1 bit)
+    static juce::uint64 pack(const Estimate& estimate)
+    {
+        return ((juce::uint64) (juce::uint32) estimate.jobId << 32)
+             | ((juce::uint64) (estimate.note + 1) << 24)
+             | ((juce::uint64) juce::roundToInt(juce::jlimit(0.0f, 1.0f, estimate.progress) * 1000.0f) << 8)
+             | ((juce::uint64) juce::roundToInt(juce::jlimit(-50.0f, 50.0f, estimate.fineTuneCents) + 50.0f) << 1)
+             | (estimate.complete ? 1u : 0u);
+    }
+
+    static Estimate unpack(juce::uint64 word)
+    {
+        Estimate estimate;
+        estimate.jobId = (int) (word >> 32);
+        estimate.note = (int) ((word >> 24) & 0xff) - 1;
+        estimate.progress = (float) ((word >> 8) & 0xffff) / 1000.0f;
+        estimate.fineTuneCents = (float) ((word >> 1) & 0x7f) - 50.0f;
+        estimate.complete = (word & 1) != 0;
+        return estimate;
+    }
+
+    ParallelPitchAnalyser& analyser;
+
+    AudioCapture source;
+    int numSamples = 0;
+    int windowSize = 2048;
+    int hopSize = 512;
+    std::vector<PitchStatistics::Frame> frameData; // Per frame, note -1 for no pitch, notAnalysed() until done
+
+    std::mutex jobMutex;
+    std::condition_variable jobFinished;
+    JobHandle pendingJob, runningJob;
+    int lastJobId = 0;
+
+    std::atomic<juce::uint64> mailbox { 0 };
+    std::shared_ptr<const PitchNoteIndex> completedIndex;
+};
+
+//==============================================================================
+/**
+ * Hann-windowed magnitude spectra of every full frame of a capture, stored frame
+ * after frame, with each frame's magnitude sum and bin-weighted magnitude sum for
+ * cheap centroid queries. Frame i covers samples [i * hopSize, + windowSize).
+ * Handed out read-only by SpectralFrameCache.
+ */
+struct SpectralFrames
+{
+    int windowSize = 0;
+    int hopSize = 0;
+    int numFrames = 0;
+    int numBins = 0; // windowSize / 2 + 1
+    std::vector<float> magnitudes;
+    std::vector<double> magnitudeSums, weightedBinSums;
+
+    const float* getFrame(int frame) const { return magnitudes.data() + (size_t) frame * numBins; }
+
+    size_t getSizeInBytes() const
+    {
+        return magnitudes.size() * sizeof(float) + (magnitudeSums.size() + weightedBinSums.size()) * sizeof(double);
+    }
+
+    /** Magnitude-weighted mean frequency over the frames lying entirely inside [startSample, endSample), 0 if silent */
+    float getCentroid(int startSample, int endSample, double sampleRate) const
+    {
+        if (numFrames == 0)
+            return 0.0f;
+
+        const int firstFrame = juce::jmax(0, (startSample + hopSize - 1) / hopSize);
+        const int endFrame = juce::jmin(numFrames, PitchTrack::countFrames(endSample, windowSize, hopSize));
+
+        double magnitude = 0.0, weighted = 0.0;
+        for (int frame = firstFrame; frame < endFrame; ++frame)
+        {
+            magnitude += magnitudeSums[(size_t) frame];
+            weighted += weightedBinSums[(size_t) frame];
+        }
+
+        return magnitude > 0.0 ? (float) (weighted / magnitude * sampleRate / windowSize) : 0.0f;
+    }
+};
+
+//==============================================================================
+/**
+ * Computes the Hann-windowed magnitude STFT of a capture once, for the analyses
+ * that read magnitude spectra (the spectral centroid). Pitch needs unwindowed
+ * autocorrelations, onsets are found on the audio thread before any capture
+ * exists, and the loop search correlates with phase over a span of its own, so
+ * none of those can be answered from these frames. Entries are keyed by
+ * (buffer generation, window, hop) and built on the cache's own thread, in
+ * parallel on the shared AnalysisThreadPool, two real frames per complex FFT,
+ * so the message thread never waits for a whole capture's FFTs. The least
+ * recently used entries are dropped once the cache grows past its memory
+ * limit; views already handed out stay valid until their holders let go.
+ */
+class SpectralFrameCache : private juce::Thread
+{
+public:
+    using FramesPtr = std::shared_ptr<const SpectralFrames>;
+
+    explicit SpectralFrameCache(size_t maxBytes = 64 * 1024 * 1024)
+        : juce::Thread("Spectral frames"), memoryLimit(maxBytes)
+    {
+        startThread();
+    }
+
+    ~SpectralFrameCache() override
+    {
+        cancelAndWait();
+        stopThread(2000);
+    }
+
+    void setMemoryLimit(size_t maxBytes)
+    {
+        std::lock_guard<std::mutex> lock(entriesLock);
+        memoryLimit = maxBytes;
+        evictToLimit();
+    }
+
+    size_t getCachedBytes() const
+    {
+        std::lock_guard<std::mutex> lock(entriesLock);
+        return cachedBytes;
+    }
+
+    /** True if the frames of a capture this long would fit in the memory limit on their own */
+    bool fitsMemoryLimit(int numSamples, int windowSize, int hopSize) const
+    {
+        const size_t numFrames = (size_t) PitchTrack::countFrames(numSamples, windowSize, hopSize);
+        const size_t bytes = numFrames * ((size_t) (windowSize / 2 + 1) * sizeof(float) + 2 * sizeof(double));
+
+        std::lock_guard<std::mutex> lock(entriesLock);
+        return bytes <= memoryLimit;
+    }
+
+    /** The cached frames for a key, or nullptr; never computes */
+    FramesPtr findFrames(juce::uint32 generation, int windowSize, int hopSize)
+    {
+        std::lock_guard<std::mutex> lock(entriesLock);
+        return lookUp({ generation, windowSize, hopSize });
+    }
+
+    /**
+     * Starts building the frames for a key in the background unless they are
+     * cached already, replacing any request still queued. The request holds on
+     * to the capture until it has been built or dropped.
+     */
+    void prefetch(juce::uint32 generation, const AudioCapture& source, int windowSize, int hopSize)
+    {
+        if (findFrames(generation, windowSize, hopSize) != nullptr)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(requestLock);
+            pendingRequest = { { generation, windowSize, hopSize }, source };
+            hasPendingRequest = true;
+        }
+
+        notify();
+    }
+
+    /** Drops a queued prefetch and waits for one being built */
+    void cancelAndWait()
+    {
+        std::unique_lock<std::mutex> lock(requestLock);
+
+        hasPendingRequest = false;
+        pendingRequest = {};
+        cancelBuild.store(true);
+
+        requestFinished.wait(lock, [this] { return ! building; });
+    }
+
+    /** Drops the entries of every capture older than generation */
+    void discardGenerationsBefore(juce::uint32 generation)
+    {
+        std::lock_guard<std::mutex> lock(entriesLock);
+
+        for (auto it = entries.begin(); it != entries.end();)
+        {
+            if (it->key.generation < generation)
+            {
+                cachedBytes -= it->frames->getSizeInBytes();
+                it = entries.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+private:
+    struct Key
+    {
+        juce::uint32 generation;
+        int windowSize;
+        int hopSize;
+
+        bool operator==(const Key& other) const
+        {
+            return generation == other.generation && windowSize == other.windowSize && hopSize == other.hopSize;
+        }
+    };
+
+    struct Entry
+    {
+        Key key;
+        FramesPtr frames;
+    };
+
+    struct Request
+    {
+        Key key;
+        AudioCapture source;
+    };
+
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            Request request;
+            {
+                std::lock_guard<std::mutex> lock(requestLock);
+
+                if (hasPendingRequest)
+                {
+                    request = std::move(pendingRequest);
+                    hasPendingRequest = false;
+                    building = true;
+                    cancelBuild.store(false);
+                }
+            }
+
+            if (! building)
+            {
+                wait(-1);
+                continue;
+            }
+
+            if (auto frames = compute(request.source, request.key.windowSize, request.key.hopSize, &cancelBuild))
+                insert(request.key, std::move(frames));
+
+            {
+                std::lock_guard<std::mutex> lock(requestLock);
+                building = false;
+            }
+            requestFinished.notify_all();
+        }
+    }
+
+    FramesPtr insert(const Key& key, FramesPtr frames)
+    {
+        std::lock_guard<std::mutex> lock(entriesLock);
+
+        // Another caller may have built the same key meanwhile
+        if (auto existing = lookUp(key))
+            return existing;
+
+        entries.push_front({ key, frames });
+        cachedBytes += frames->getSizeInBytes();
+        evictToLimit();
+        return frames;
+    }
+
+    /** Caller holds entriesLock; a hit becomes the most recently used entry */
+    FramesPtr lookUp(const Key& key)
+    {
+        for (auto it = entries.begin(); it != entries.end(); ++it)
+        {
+            if (it->key == key)
+            {
+                entries.splice(entries.begin(), entries, it);
+                return entries.front().frames;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /** Caller holds entriesLock; the newest entry is always kept, even on its own over the limit */
+    void evictToLimit()
+    {
+        while (cachedBytes > memoryLimit && entries.size() > 1)
+        {
+            cachedBytes -= entries.back().frames->getSizeInBytes();
+            entries.pop_back();
+        }
+    }
+
+    /** Builds the frames on the pool; returns nullptr if cancel gets set meanwhile */
+    FramesPtr compute(const AudioCapture& source, int windowSize, int hopSize, const std::atomic<bool>* cancel)
+    {
+        jassert(juce::isPowerOfTwo(windowSize));
+
+        auto frames = std::make_shared<SpectralFrames>();
+        frames->windowSize = windowSize;
+        frames->hopSize = hopSize;
+        frames->numFrames = PitchTrack::countFrames(source.getNumSamples(), windowSize, hopSize);
+        frames->numBins = windowSize / 2 + 1;
+        frames->magnitudes.resize((size_t) frames->numFrames * frames->numBins);
+        frames->magnitudeSums.resize((size_t) frames->numFrames);
+        frames->weightedBinSums.resize((size_t) frames->numFrames);
+
+        // Periodic Hann window with the stereo downmix folded in
+        const bool stereo = source.getNumChannels() > 1;
+        std::vector<double> window((size_t) windowSize);
+        for (int i = 0; i < windowSize; ++i)
+            window[(size_t) i] = (stereo ? 0.25 : 0.5) * (1.0 - std::cos(juce::MathConstants<double>::twoPi * i / windowSize));
+
+        const FFTPlan plan(windowSize);
+        std::vector<std::vector<std::complex<double>>> workerBuffers((size_t) pool->getNumWorkers(),
+                                                                     std::vector<std::complex<double>>((size_t) windowSize));
+
+        // Room for both channels of both frames, for frames that straddle two capture segments
+        std::vector<std::vector<float>> workerScratch((size_t) pool->getNumWorkers(), std::vector<float>((size_t) windowSize * 4));
+
+        auto& result = *frames;
+        const int numPairs = (result.numFrames + 1) / 2;
+
+        pool->parallelFor(numPairs, [&](int worker, int pair)
+        {
+            if (cancel != nullptr && cancel->load())
+                return;
+
+            auto& fftBuffer = workerBuffers[(size_t) worker];
+            float* scratch = workerScratch[(size_t) worker].data();
+            const int first = pair * 2;
+            const bool hasSecond = first + 1 < result.numFrames;
+
+            // Step 1: First frame in the real part, second in the imaginary part
+            auto read = [&](int frame, int channel, int scratchSlot) -> const float*
+            {
+                if (frame >= result.numFrames || channel >= source.getNumChannels())
+                    return nullptr;
+
+                return source.getReadPointer(channel, frame * hopSize, windowSize, scratch + scratchSlot * windowSize);
+            };
+
+            const float* firstLeft = read(first, 0, 0);
+            const float* firstRight = read(first, 1, 1);
+            const float* secondLeft = read(first + 1, 0, 2);
+            const float* secondRight = read(first + 1, 1, 3);
+
+            auto sample = [](const float* left, const float* right, int i)
+            {
+                return right != nullptr ? (double) left[i] + right[i] : (double) left[i];
+            };
+
+            for (int i = 0; i < windowSize; ++i)
+                fftBuffer[(size_t) i] = { window[(size_t) i] * sample(firstLeft, firstRight, i),
+                                          hasSecond ? window[(size_t) i] * sample(secondLeft, secondRight, i) : 0.0 };
+
+            plan.perform(fftBuffer.data(), false);
+
+            // Step 2: Split the two spectra, X = (Z[k] + conj Z[N-k]) / 2 and Y = (Z[k] - conj Z[N-k]) / 2i
+            for (int part = 0; part < (hasSecond ? 2 : 1); ++part)
+            {
+                const int frame = first + part;
+                float* magnitudes = result.magnitudes.data() + (size_t) frame * result.numBins;
+                double magnitudeSum = 0.0, weightedSum = 0.0;
 
-        static const char* noteNames[] = { "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B" };
+                for (int bin = 0; bin < result.numBins; ++bin)
+                {
+                    const auto z = fftBuffer[(size_t) bin];
+                    const auto mirrored = std::conj(fftBuffer[(size_t) ((windowSize - bin) & (windowSize - 1))]);
+                    const auto spectrum = part == 0 ? 0.5 * (z + mirrored) : std::complex<double>(0.0, -0.5) * (z - mirrored);
+
+                    const double magnitude = std::abs(spectrum);
+                    magnitudes[bin] = (float) magnitude;
+                    magnitudeSum += magnitude;
+                    weightedSum += magnitude * bin;
+                }
 
-        // A4 = 440Hz = 69th midi note
-        float midiNote = 12.0f * std::log2(frequency / 440.0f) + 69.0f;
-        int roundedMidiNote = juce::roundToInt(midiNote);
+                result.magnitudeSums[(size_t) frame] = magnitudeSum;
+                result.weightedBinSums[(size_t) frame] = weightedSum;
+            }
+        });
 
-        // Calculate octave and note
-        int octave = (roundedMidiNote / 12) - 1;
-        int noteIndex = roundedMidiNote % 12;
+        if (cancel != nullptr && cancel->load())
+            return nullptr;
 
-        return juce::String(noteNames[noteIndex]) + juce::String(octave);
+        return frames;
     }
 
-    int midiNoteFromFrequency(float frequency)
-    {
-        if (frequency <= 0.0f)
-            return -1;
+    juce::SharedResourcePointer<AnalysisThreadPool> pool;
 
-        // A4 = 440Hz = 69th midi note
-        float midiNote = 12.0f * std::log2(frequency / 440.0f) + 69.0f;
-        return juce::roundToInt(midiNote);
-    }
+    mutable std::mutex entriesLock;
+    std::list<Entry> entries; // Most recently used first
+    size_t memoryLimit;
+    size_t cachedBytes = 0;
 
-private:
-    double sampleRate;
-    int bufferSize;
-    std::vector<float> yinBuffer;
+    std::mutex requestLock;
+    std::condition_variable requestFinished;
+    Request pendingRequest {};
+    bool hasPendingRequest = false;
+    bool building = false; // Written by the cache thread under requestLock
+    std::atomic<bool> cancelBuild { false };
 };
 
 //==============================================================================
 /**
- * Circular audio buffer to continuously record incoming audio
+ * Pitch-synchronous sustain loop search on a trimmed sample. The loop starts
+ * just after the attack peak and spans a whole number of periods of the detected
+ * fundamental, ending before the level has fallen by 3 dB, so a decaying note
+ * doesn't jump back up in level at every wrap. The exact end comes
+ * from FFT cross-correlation: the waveform around the loop start is matched
+ * against every candidate end within one period of the nominal one, and the best
+ * normalised match wins. An equal-power crossfade can then be baked into the
+ * samples leading up to the loop end, so the wrap stays seamless where the
+ * waveform drifts.
  */
-class CircularAudioBuffer
+class SustainLoopFinder
 {
 public:
-    CircularAudioBuffer(int numChannels, int maxLengthInSamples)
-        : buffer(numChannels, maxLengthInSamples)
+    struct Loop
     {
-        writePos = 0;
-        size = maxLengthInSamples;
-    }
+        int start = 0;
+        int end = 0;        // Exclusive; playback wraps from end back to start
+        float match = 0.0f; // Normalised correlation at the join
 
-    void write(const juce::AudioBuffer<float>& sourceBuffer)
+        bool isValid() const { return end > start; }
+    };
+
+    /** Joins correlating worse than this are audible, so no loop is returned */
+    static constexpr float minimumMatch = 0.9f;
+
+    static Loop find(const juce::AudioBuffer<float>& sample, double sampleRate, float fundamental)
     {
-        const int numSamples = sourceBuffer.getNumSamples();
-        const int numChannels = juce::jmin(sourceBuffer.getNumChannels(), buffer.getNumChannels());
+        const int numSamples = sample.getNumSamples();
 
-        for (int channel = 0; channel < numChannels; ++channel)
+        if (fundamental <= 0.0f || numSamples == 0 || sample.getNumChannels() == 0)
+            return {};
+
+        const double period = sampleRate / fundamental;
+        const int window = juce::jlimit(256, 4096, juce::nextPowerOfTwo((int) std::ceil(2.0 * period)));
+
+        if (period < 2.0 || numSamples < 8 * window)
+            return {};
+
+        // Step 1: Downmix, and a 10ms RMS envelope to find the sustain
+        std::vector<float> mono((size_t) numSamples);
+        for (int i = 0; i < numSamples; ++i)
         {
-            int pos = writePos;
+            float sum = 0.0f;
+            for (int channel = 0; channel < sample.getNumChannels(); ++channel)
+                sum += sample.getSample(channel, i);
 
-            for (int i = 0; i < numSamples; ++i)
-            {
-                buffer.setSample(channel, pos, sourceBuffer.getSample(channel, i));
+            mono[(size_t) i] = sum / (float) sample.getNumChannels();
+        }
 
-                if (++pos >= size)
-                    pos = 0;
+        const int blockSize = juce::jmax(1, juce::roundToInt(0.01 * sampleRate));
+        std::vector<float> envelope((size_t) (numSamples / blockSize));
+        for (size_t block = 0; block < envelope.size(); ++block)
+        {
+            double energy = 0.0;
+            for (int i = 0; i < blockSize; ++i)
+                energy += (double) mono[block * (size_t) blockSize + (size_t) i] * mono[block * (size_t) blockSize + (size_t) i];
+
+            envelope[block] = (float) std::sqrt(energy / blockSize);
+        }
+
+        if (envelope.empty())
+            return {};
+
+        // Step 2: Loop start 50ms after the attack peak, loop end before the level drops 3dB from there
+        const int peakBlock = (int) (std::max_element(envelope.begin(), envelope.end()) - envelope.begin());
+        const int start = juce::jmax(window / 2, (peakBlock + 6) * blockSize);
+        const int startBlock = start / blockSize;
+
+        if (startBlock >= (int) envelope.size())
+            return {};
+
+        int sustainEnd = numSamples;
+        for (int block = startBlock; block < (int) envelope.size(); ++block)
+        {
+            if (envelope[(size_t) block] < 0.7f * envelope[(size_t) startBlock])
+            {
+                sustainEnd = block * blockSize;
+                break;
             }
         }
 
-        writePos = (writePos + numSamples) % size;
+        sustainEnd = juce::jmin(sustainEnd, numSamples - window / 2 - (int) std::ceil(period) - 1);
+
+        const int numPeriods = (int) std::floor((sustainEnd - start) / period) - 1;
+        if (numPeriods < 2)
+            return {};
+
+        const double nominalEnd = start + numPeriods * period;
+        const int firstEnd = (int) std::floor(nominalEnd - period);
+        const int lastEnd = juce::jmin(sustainEnd, (int) std::ceil(nominalEnd + period));
+
+        // Step 3: Correlate the window around start with every candidate end
+        return matchEnd(mono, start, firstEnd, lastEnd, window);
     }
 
-    void copyTo(juce::AudioBuffer<float>& destBuffer, int startSample, int endSample)
+    /**
+     * Blends the crossfadeSamples before loop.end towards the samples before
+     * loop.start, so the waveform arrives at the end exactly as it leaves the start.
+     */
+    static void bakeCrossfade(juce::AudioBuffer<float>& sample, const Loop& loop, int crossfadeSamples)
     {
-        const int numChannels = juce::jmin(destBuffer.getNumChannels(), buffer.getNumChannels());
-        const int numSamples = juce::jmin(destBuffer.getNumSamples(), endSample - startSample);
+        const int length = juce::jmin(crossfadeSamples, loop.start, loop.end - loop.start);
 
-        for (int channel = 0; channel < numChannels; ++channel)
+        if (! loop.isValid() || length <= 0)
+            return;
+
+        for (int channel = 0; channel < sample.getNumChannels(); ++channel)
         {
-            int readPos = (writePos - size + startSample) % size;
-            if (readPos < 0) readPos += size;
+            float* data = sample.getWritePointer(channel);
 
-            for (int i = 0; i < numSamples; ++i)
+            for (int i = 0; i < length; ++i)
             {
-                destBuffer.setSample(channel, i, buffer.getSample(channel, readPos));
-
-                if (++readPos >= size)
-                    readPos = 0;
+                const float angle = juce::MathConstants<float>::halfPi * (float) (i + 1) / (float) length;
+                float& out = data[loop.end - length + i];
+                out = out * std::cos(angle) + data[loop.start - length + i] * std::sin(angle);
             }
         }
     }
 
-    int getSize() const { return size; }
-    int getWritePosition() const { return writePos; }
-
 private:
-    juce::AudioBuffer<float> buffer;
-    int writePos;
-    int size;
+    /** Best normalised correlation of mono around start against ends in [firstEnd, lastEnd] */
+    static Loop matchEnd(const std::vector<float>& mono, int start, int firstEnd, int lastEnd, int window)
+    {
+        const int halfWindow = window / 2;
+        const int numCandidates = lastEnd - firstEnd + 1;
+        const int regionLength = window + numCandidates - 1;
+        const int fftSize = juce::nextPowerOfTwo(regionLength);
+
+        const float* region = mono.data() + firstEnd - halfWindow;
+        const float* pattern = mono.data() + start - halfWindow;
+
+        // The search region in the real part and the pattern in the imaginary part; one FFT gives both spectra
+        std::vector<std::complex<double>> buffer((size_t) fftSize);
+        for (int i = 0; i < regionLength; ++i)
+            buffer[(size_t) i] = { region[i], i < window ? pattern[i] : 0.0 };
+
+        const FFTPlan plan(fftSize);
+        plan.perform(buffer.data(), false);
+
+        // Cross spectrum R * conj(P), with R = (Z[k] + conj Z[N-k]) / 2 and P = (Z[k] - conj Z[N-k]) / 2i
+        std::vector<std::complex<double>> cross((size_t) fftSize);
+        for (int k = 0; k < fftSize; ++k)
+        {
+            const auto z = buffer[(size_t) k];
+            const auto mirrored = std::conj(buffer[(size_t) ((fftSize - k) & (fftSize - 1))]);
+            const auto regionSpectrum = 0.5 * (z + mirrored);
+            const auto patternSpectrum = std::complex<double>(0.0, -0.5) * (z - mirrored);
+
+            cross[(size_t) k] = regionSpectrum * std::conj(patternSpectrum);
+        }
+
+        plan.perform(cross.data(), true);
+
+        // Normalise by the energies of the pattern and of each candidate window
+        double patternEnergy = 0.0;
+        for (int i = 0; i < window; ++i)
+            patternEnergy += (double) pattern[i] * pattern[i];
+
+        std::vector<double> energyPrefix((size_t) regionLength + 1, 0.0);
+        for (int i = 0; i < regionLength; ++i)
+            energyPrefix[(size_t) i + 1] = energyPrefix[(size_t) i] + (double) region[i] * region[i];
+
+        Loop best;
+        for (int candidate = 0; candidate < numCandidates; ++candidate)
+        {
+            const double energy = patternEnergy * (energyPrefix[(size_t) (candidate + window)] - energyPrefix[(size_t) candidate]);
+            if (energy <= 0.0)
+                continue;
+
+            const float match = (float) (cross[(size_t) candidate].real() / std::sqrt(energy));
+            if (match > best.match)
+            {
+                best.match = match;
+                best.start = start;
+                best.end = firstEnd + candidate;
+            }
+        }
+
+        if (best.match < minimumMatch)
+            return {};
+
+        return best;
+    }
 };
 
 //==============================================================================
@@ -206,9 +5562,13 @@ private:
 
     int rootNote = 60; // C4
 
-    int sourceSamplePosition = 0;
+    double sourceSamplePosition = 0.0;
     juce::AudioBuffer<float>* sampleBuffer = nullptr;
 
+    // Sustain loop of the sound, empty if it plays through once
+    int loopStart = 0;
+    int loopEnd = 0;
+
     // Need to store rate to adjust for different pitches
     double rate = 1.0;
 };
@@ -220,8 +5580,9 @@ private:
 class BufferedSamplerSound : public juce::SynthesiserSound
 {
 public:
-    BufferedSamplerSound(juce::AudioBuffer<float>& buffer, int rootNote)
-        : sampleBuffer(buffer), rootNote(rootNote) {
+    BufferedSamplerSound(juce::AudioBuffer<float> buffer, int rootNote, float rootCents = 0.0f,
+                         SustainLoopFinder::Loop sustainLoop = {})
+        : sampleBuffer(std::move(buffer)), rootNote(rootNote), rootCents(rootCents), sustainLoop(sustainLoop) {
     }
 
     bool appliesToNote(int midiNoteNumber) override { return true; }
@@ -229,10 +5590,14 @@ public:
 
     juce::AudioBuffer<float>& getSampleBuffer() { return sampleBuffer; }
     int getRootNote() const { return rootNote; }
+    float getRootCents() const { return rootCents; } // How far the recording sits from rootNote
+    const SustainLoopFinder::Loop& getSustainLoop() const { return sustainLoop; }
 
 private:
     juce::AudioBuffer<float> sampleBuffer;
     int rootNote;
+    float rootCents;
+    SustainLoopFinder::Loop sustainLoop;
 };
 
 //==============================================================================
@@ -280,6 +5645,16 @@ public:
     //==============================================================================
     void setBufferDuration(float seconds);
     void enterTrimMode();
+
+    /**
+     * Keeps this much history in a memory-mapped file on disk as well as in the RAM ring, so
+     * captures can reach further back; 0 for the RAM history only. The file is written out in the
+     * background; false if its volume lacks the space, and getDiskHistorySeconds() drops to 0 if
+     * writing it fails later.
+     */
+    bool setDiskHistorySeconds(double seconds);
+    double getDiskHistorySeconds() const { return diskHistory != nullptr && ! diskHistory->hasFailed() ? diskHistorySeconds : 0.0; }
+    bool isDiskHistoryReady() const { return diskHistory != nullptr && diskHistory->isReady(); } // False while the file is still being written
     void enterSamplerMode();
 
     PluginState getState() const { return state; }
@@ -292,21 +5667,63 @@ public:
     void previewTrimmedSample();
     void stopPreview();
 
-    int getMostCommonNote() const { return mostCommonNote; }
+    // Sustain loop found when entering sampler mode, crossfaded over the given time (0 for none)
+    void setSustainLoopEnabled(bool shouldLoop) { sustainLoopEnabled = shouldLoop; }
+    bool isSustainLoopEnabled() const { return sustainLoopEnabled; }
+    void setLoopCrossfadeSeconds(float seconds) { loopCrossfadeSeconds = juce::jmax(0.0f, seconds); }
+    float getLoopCrossfadeSeconds() const { return loopCrossfadeSeconds; }
+
+    int getMostCommonNote() const;
+    float getFineTuneCents() const; // Tuning of the most common note, in cents
+    PitchAnalysisService::Estimate getPitchAnalysisStatus() const;
     void detectPitch();
 
+    /** Spectral centroid in Hz of the current trim range; 0 if silent or while the spectra are still being built */
+    float getSpectralCentroid();
+
+    /** Window, hop, frequency range and threshold used for all pitch analysis */
+    void setAnalysisConfig(const PitchAnalysisConfig& newConfig);
+    const PitchAnalysisConfig& getAnalysisConfig() const { return analysisConfig; }
+
+    /** Limits the pitch search to an instrument range; the window follows the sample rate */
+    void setPitchRangePreset(PitchRangePreset newPreset);
+    PitchRangePreset getPitchRangePreset() const { return rangePreset; }
+
+    // Pitch engine used for this instance's analysis; kept across range presets
+    void setPitchEngine(PitchEngineType newEngine);
+    PitchEngineType getPitchEngine() const { return analysisConfig.engine; }
+
     CircularAudioBuffer& getCircularBuffer() { return circularBuffer; }
-    juce::AudioBuffer<float>& getTrimmedBuffer() { return trimmedBuffer; }
+    const AudioCapture& getTrimmedCapture() const { return trimmedCapture; }
+    const WaveformOverview& getWaveformOverview() const { return waveformOverview; }
+    juce::uint32 getCaptureGeneration() const { return captureGeneration; } // Changes with every capture
 
 private:
     //==============================================================================
-    PluginState state = PluginState::Recording;
+    void buildPitchIndex();
+    void updateMostCommonNote();
+    void proposeTrimPositions(juce::int64 absoluteStart, int totalSamples);
+    int snapToZeroCrossing(float position) const;
+    juce::int64 getCaptureCapacity() const; // Longest capture, in samples
+    void updateSpectralFrames();
+    void updateSpectralCentroid();
+
+    std::atomic<PluginState> state { PluginState::Recording };
 
-    // Circular buffer for continuous recording
+    // Circular buffer for continuous recording, holding the newest audio as raw samples
     CircularAudioBuffer circularBuffer;
 
-    // Buffer for the trimmed sample
-    juce::AudioBuffer<float> trimmedBuffer;
+    // Losslessly compressed history from before that, fed from the ring in the background
+    CompressedHistory compressedHistory;
+
+    // Older history on disk, fed from the ring in the background; nullptr when off
+    std::unique_ptr<DiskHistory> diskHistory;
+    double diskHistorySeconds = 0.0;
+
+    // The captured audio being trimmed, read in place from frozen ring segments
+    AudioCapture trimmedCapture;
+    ZeroCrossingIndex zeroCrossings; // Of trimmedCapture, for click-free trim points
+    WaveformOverview waveformOverview; // Of trimmedCapture, for drawing
 
     // Duration of the buffer in seconds
     float bufferDuration = 60.0f;
@@ -316,15 +5733,62 @@ private:
     float endPosition = 1.0f;
 
     // Pitch detection
+    PitchAnalysisConfig analysisConfig;
+    PitchRangePreset rangePreset = PitchRangePreset::Full;
+    bool analysisConfigFromPreset = true; // False once a custom config has been set
     std::unique_ptr<PitchDetector> pitchDetector;
-    std::map<int, int> noteHistogram;
+    PitchStatistics noteStatistics; // Weighted note statistics of the trim range
+
+    // Pitch tracked while recording, and the part of it covering trimmedCapture
+    StreamingPitchTracker pitchTracker;
+    std::vector<PitchEstimate> trimmedPitchTrack;
+    int trimmedPitchTrackOffset = 0; // Position in trimmedCapture of the first frame
+    bool trimmedPitchTrackValid = false; // True if the frames cover all recorded audio in trimmedCapture
+
+    // Onsets and offsets found while recording, for proposing trim points
+    StreamingOnsetDetector onsetDetector;
+    std::vector<StreamingOnsetDetector::Event> trimmedOnsets;
+
+    // Note index over trimmedCapture, so any trim range is answered without re-analysis
+    std::shared_ptr<const PitchNoteIndex> pitchIndex;
+    ParallelPitchAnalyser parallelAnalyser;
     int mostCommonNote = 60; // Default to C4
+    float fineTuneCents = 0.0f;
+
+    // Builds the index in the background when no tracked frames cover the capture
+    PitchAnalysisService analysisService { parallelAnalyser };
+    int currentAnalysisJobId = 0; // 0 while the root note comes from pitchIndex
+
+    // Magnitude STFT of trimmedCapture for the spectral centroid; the generation changes with every capture
+    SpectralFrameCache spectralCache;
+    SpectralFrameCache::FramesPtr spectralFrames;
+    juce::uint32 captureGeneration = 0;
+    float spectralCentroid = 0.0f;
 
     // Sampler
     juce::Synthesiser sampler;
+    bool sustainLoopEnabled = true;
+    float loopCrossfadeSeconds = 0.02f;
+
+    // Preview audio, built on the message thread and handed to the audio thread without locking
+    struct PreviewSource
+    {
+        AudioCapture capture; // The capture itself, or a RAM copy of the range when it is on disk
+        int startPosition = 0;
+        juce::uint32 id = 0;
+    };
+
+    const PreviewSource* acquirePreviewSource();
+    void publishPreviewSource(std::unique_ptr<PreviewSource> source);
+    void releasePreviewSources(bool waitForAudioThread);
 
     // Preview state
-    bool isPreviewActive = false;
+    std::atomic<bool> isPreviewActive { false };
+    std::atomic<const PreviewSource*> publishedPreview { nullptr };
+    std::atomic<const PreviewSource*> previewInUse { nullptr }; // Set by the audio thread only while it reads a source
+    std::vector<std::unique_ptr<PreviewSource>> previewSources; // Message thread: every source not yet released
+    juce::uint32 nextPreviewId = 0;
+    juce::uint32 previewSourceId = 0; // Audio thread: the source previewPosition belongs to
     int previewPosition = 0;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(BufferedRecorderSamplerProcessor)
@@ -337,6 +5801,7 @@ private:
 class BufferedRecorderSamplerEditor : public juce::AudioProcessorEditor,
     private juce::Button::Listener,
     private juce::Slider::Listener,
+    private juce::ComboBox::Listener,
     private juce::Timer
 {
 public:
@@ -349,11 +5814,14 @@ public:
 
     void buttonClicked(juce::Button* button) override;
     void sliderValueChanged(juce::Slider* slider) override;
+    void comboBoxChanged(juce::ComboBox* comboBox) override;
 
     void timerCallback() override;
 
 private:
     void updateControlsVisibility();
+    void enterTrimMode(float bufferSeconds);
+    void updateWaveformPath();
 
     // Reference to the processor
     BufferedRecorderSamplerProcessor& processor;
@@ -362,6 +5830,9 @@ private:
     juce::TextButton buffer10sButton{ "10s" };
     juce::TextButton buffer30sButton{ "30s" };
     juce::TextButton buffer60sButton{ "60s" };
+    juce::TextButton buffer2mButton{ "2 min" };
+    juce::TextButton buffer60mButton{ "60 min" };
+    juce::ToggleButton diskHistoryToggle{ "Keep the last hour on disk" };
 
     // UI components for trimming mode
     juce::Slider startSlider;
@@ -369,12 +5840,17 @@ private:
     juce::TextButton previewButton{ "Preview" };
     juce::TextButton doneButton{ "Done" };
     juce::Label pitchLabel{ {}, "Detected Pitch: " };
+    juce::ComboBox rangeBox;
+    juce::ComboBox engineBox;
+    juce::Label centroidLabel{ {}, "Brightness: " };
 
     // UI components for sampler mode
     juce::Label samplerInfoLabel{ {}, "Sampler Mode" };
 
-    // Visual feedback
+    // Visual feedback, rebuilt from the processor's overview when the capture or the width changes
     juce::Path waveformPath;
+    juce::uint32 waveformGeneration = 0;
+    int waveformWidth = 0;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(BufferedRecorderSamplerEditor)
 };
@@ -386,9 +5862,10 @@ BufferedRecorderSamplerProcessor::BufferedRecorderSamplerProcessor()
     : AudioProcessor(BusesProperties()
         .withInput("Input", juce::AudioChannelSet::stereo(), true)
         .withOutput("Output", juce::AudioChannelSet::stereo(), true)),
-    circularBuffer(2, 48000 * 60) // 60 seconds max at 48kHz
+    circularBuffer(2, 48000 * 6), // 6 seconds raw at 48kHz
+    // Segments compressed once they are 3 seconds old; at least 60 seconds even if nothing compresses, up to 3 minutes
+    compressedHistory(circularBuffer, 48000 * 3, (juce::int64) 48000 * 60, (juce::int64) 48000 * 180)
 {
-    trimmedBuffer.setSize(2, 48000 * 60); // Max buffer size
 }
 
 BufferedRecorderSamplerProcessor::~BufferedRecorderSamplerProcessor()
@@ -443,10 +5920,28 @@ void BufferedRecorderSamplerProcessor::changeProgramName(int index, const juce::
 {
 }
 
-void BufferedRecorderSamplerProcessor::prepareToPlay(double sampleRate, int samplesPerBlock)
+void BufferedRecorderSamplerProcessor::prepareToPlay(double sampleRate, int /*samplesPerBlock*/)
 {
-    // Initialize pitch detector
-    pitchDetector = std::make_unique<PitchDetector>(sampleRate, samplesPerBlock);
+    // Background analysis uses the workspaces rebuilt below
+    analysisService.cancelAndWait();
+
+    // Initialize pitch detectors; their workspaces depend on the analysis config, not the host block size
+    if (analysisConfigFromPreset)
+    {
+        const auto engine = analysisConfig.engine;
+        analysisConfig = PitchAnalysisConfig::forPreset(rangePreset, sampleRate);
+        analysisConfig.engine = engine;
+    }
+
+    pitchDetector = std::make_unique<PitchDetector>(sampleRate, analysisConfig);
+    parallelAnalyser.prepare(sampleRate, analysisConfig);
+
+    // Initialize the tracker that follows the circular buffer while recording, over all the RAM history can reach
+    const int trackedLength = (int) compressedHistory.getMaxCapacity();
+    pitchTracker.prepare(sampleRate, trackedLength, circularBuffer.getTotalSamplesWritten(), analysisConfig);
+    trimmedPitchTrack.reserve(trackedLength / pitchTracker.getHopSize() + 1);
+
+    onsetDetector.prepare(sampleRate, circularBuffer.getTotalSamplesWritten(), analysisConfig.silenceThreshold, trackedLength);
 
     // Initialize sampler
     sampler.setCurrentPlaybackSampleRate(sampleRate);
@@ -496,36 +5991,42 @@ void BufferedRecorderSamplerProcessor::processBlock(juce::AudioBuffer<float>& bu
     if (state == PluginState::Recording)
     {
         circularBuffer.write(buffer);
+        pitchTracker.process(buffer);
+        onsetDetector.process(buffer);
     }
 
     // Process audio based on state
     if (state == PluginState::Recording || state == PluginState::Trimming)
     {
         // If previewing in trim mode, mix the preview with the input
-        if (state == PluginState::Trimming && isPreviewActive)
+        const PreviewSource* source = state == PluginState::Trimming && isPreviewActive ? acquirePreviewSource() : nullptr;
+
+        if (source != nullptr)
         {
+            // A new source starts from its own position
+            if (source->id != previewSourceId)
+            {
+                previewSourceId = source->id;
+                previewPosition = source->startPosition;
+            }
+
+            const AudioCapture& previewCapture = source->capture;
+
             // Create temporary buffer for preview
             juce::AudioBuffer<float> previewBuffer(buffer.getNumChannels(), buffer.getNumSamples());
             previewBuffer.clear();
 
-            int samplesToCopy = juce::jmin(numSamples, trimmedBuffer.getNumSamples() - previewPosition);
+            int samplesToCopy = juce::jmin(numSamples, previewCapture.getNumSamples() - previewPosition);
 
             if (samplesToCopy > 0)
             {
-                // Copy from trimmed buffer to preview buffer
-                for (int channel = 0; channel < previewBuffer.getNumChannels(); ++channel)
-                {
-                    previewBuffer.copyFrom(channel, 0,
-                        trimmedBuffer,
-                        channel,
-                        previewPosition,
-                        samplesToCopy);
-                }
+                // Copy from the capture to preview buffer
+                previewCapture.copyTo(previewBuffer, 0, previewPosition, samplesToCopy);
 
                 previewPosition += samplesToCopy;
 
                 // Loop if we reach the end
-                if (previewPosition >= trimmedBuffer.getNumSamples())
+                if (previewPosition >= previewCapture.getNumSamples())
                     previewPosition = 0;
 
                 // Mix with input
@@ -534,6 +6035,9 @@ void BufferedRecorderSamplerProcessor::processBlock(juce::AudioBuffer<float>& bu
                     buffer.addFrom(channel, 0, previewBuffer, channel, 0, samplesToCopy);
                 }
             }
+
+            // Done with the source; the message thread may free it once it is no longer published
+            previewInUse.store(nullptr);
         }
         else
         {
@@ -561,158 +6065,462 @@ bool BufferedRecorderSamplerProcessor::hasEditor() const
 
 void BufferedRecorderSamplerProcessor::getStateInformation(juce::MemoryBlock& destData)
 {
-    // You should use this method to store your parameters in the memory block.
-    // You could do that either as raw data, or use the XML or ValueTree classes
-    // as intermediaries to make it easy to save and load complex data.
+    // You should use this method to store your parameters in the memory block.
+    // You could do that either as raw data, or use the XML or ValueTree classes
+    // as intermediaries to make it easy to save and load complex data.
+}
+
+void BufferedRecorderSamplerProcessor::setStateInformation(const void* data, int sizeInBytes)
+{
+    // You should use this method to restore your parameters from this memory block,
+    // whose contents will have been created by the getStateInformation() call.
+}
+
+void BufferedRecorderSamplerProcessor::setBufferDuration(float seconds)
+{
+    bufferDuration = seconds;
+}
+
+void BufferedRecorderSamplerProcessor::enterTrimMode()
+{
+    state = PluginState::Trimming;
+
+    // Background analysis may still be reading the previous capture
+    analysisService.cancelAndWait();
+    spectralCache.cancelAndWait();
+
+    // Calculate start and end samples (the most recent bufferDuration seconds of the RAM history, or of the disk history beyond it)
+    int totalSamples = (int) juce::jmin((juce::int64) juce::roundToInt(bufferDuration * getSampleRate()), getCaptureCapacity());
+
+    // Freeze the ring segments holding them instead of copying, decoding only what is older; recording stops after the block in flight
+    const bool fromDisk = diskHistory != nullptr && totalSamples > compressedHistory.getCapacity();
+    trimmedCapture = fromDisk ? diskHistory->freezeLatest(totalSamples) : compressedHistory.freezeLatest(totalSamples);
+    const juce::int64 absoluteStart = trimmedCapture.getStartPosition();
+
+    // Reading a capture from disk in one go would stall, so those snap from the samples around each cut instead
+    if (trimmedCapture.isInMemory())
+        zeroCrossings.build(trimmedCapture);
+    else
+        zeroCrossings.clear();
+
+    waveformOverview.build(trimmedCapture);
+
+    // A new capture: spectra of the previous one can go
+    ++captureGeneration;
+    spectralCache.discardGenerationsBefore(captureGeneration);
+
+    // Pick up the pitch frames tracked while recording over the same span; trackings switched away from can go
+    pitchTracker.releaseRetired();
+    const juce::int64 firstFrameStart = pitchTracker.copyFrames(absoluteStart, absoluteStart + totalSamples, trimmedPitchTrack);
+    trimmedPitchTrackOffset = (int) (firstFrameStart - absoluteStart);
+
+    // Samples before the first one ever recorded are silence and need no frames
+    const int recordedStart = (int) juce::jlimit((juce::int64) 0, (juce::int64) totalSamples, -absoluteStart);
+    const int trackEnd = trimmedPitchTrackOffset + ((int) trimmedPitchTrack.size() - 1) * pitchTracker.getHopSize() + pitchTracker.getWindowSize();
+
+    // A config change the audio thread hadn't switched to before recording stopped leaves frames for the wrong range or engine
+    trimmedPitchTrackValid = pitchTracker.getConfig() == analysisConfig
+                             && ! trimmedPitchTrack.empty()
+                             && trimmedPitchTrackOffset <= recordedStart + pitchTracker.getHopSize()
+                             && trackEnd >= totalSamples - pitchTracker.getHopSize();
+
+    // Propose trim positions from the onsets found while recording
+    proposeTrimPositions(absoluteStart, totalSamples);
+
+    // Reset note statistics and index the new capture
+    noteStatistics.clear();
+    buildPitchIndex();
+    updateSpectralFrames();
+    detectPitch();
+}
+
+void BufferedRecorderSamplerProcessor::proposeTrimPositions(juce::int64 absoluteStart, int totalSamples)
+{
+    startPosition = 0.0f;
+    endPosition = 1.0f;
+
+    const bool allOnsetsKept = onsetDetector.copyEvents(absoluteStart, absoluteStart + totalSamples, trimmedOnsets);
+
+    if (trimmedOnsets.empty() || totalSamples <= 0)
+        return;
+
+    // Start just before the first onset, unless the capture begins mid-sound or outlived the detector's events
+    const int preRoll = juce::roundToInt(0.01 * getSampleRate());
+    int startSample = 0;
+
+    if (allOnsetsKept && trimmedOnsets.front().isOnset)
+        startSample = juce::jmax(0, (int) (trimmedOnsets.front().position - absoluteStart) - preRoll);
+
+    // End once the last sound has died away, unless it is still going at the end of the capture
+    int endSample = totalSamples;
+
+    if (! trimmedOnsets.back().isOnset)
+    {
+        const int tail = juce::roundToInt(StreamingOnsetDetector::offsetHoldSeconds * getSampleRate());
+        endSample = juce::jmin(totalSamples, (int) (trimmedOnsets.back().position - absoluteStart) + tail);
+    }
+
+    if (endSample <= startSample)
+        return;
+
+    startPosition = (float) startSample / (float) totalSamples;
+    endPosition = (float) endSample / (float) totalSamples;
+}
+
+int BufferedRecorderSamplerProcessor::snapToZeroCrossing(float position) const
+{
+    // Within 10ms, so the cut moves by less than a cycle of anything audible
+    const int sample = juce::roundToInt(position * trimmedCapture.getNumSamples());
+    const int maxDistance = juce::roundToInt(0.01 * getSampleRate());
+
+    if (! zeroCrossings.isEmpty())
+        return zeroCrossings.snap(trimmedCapture, sample, maxDistance);
+
+    ZeroCrossingIndex nearby;
+    const int first = juce::jlimit(0, trimmedCapture.getNumSamples(), sample - maxDistance);
+    nearby.build(trimmedCapture, first, juce::jmin(trimmedCapture.getNumSamples(), sample + maxDistance + 1) - first);
+    return nearby.snap(trimmedCapture, sample, maxDistance);
+}
+
+juce::int64 BufferedRecorderSamplerProcessor::getCaptureCapacity() const
+{
+    const juce::int64 inMemory = compressedHistory.getCapacity();
+    return diskHistory != nullptr ? juce::jmax(inMemory, diskHistory->getCapacity()) : inMemory;
+}
+
+bool BufferedRecorderSamplerProcessor::setDiskHistorySeconds(double seconds)
+{
+    // Captures already taken keep their part of the old file until they're done with it
+    diskHistory = nullptr;
+    diskHistorySeconds = 0.0;
+
+    if (seconds <= 0.0)
+        return true;
+
+    const double rate = getSampleRate() > 0.0 ? getSampleRate() : 48000.0;
+    const auto file = juce::File::getSpecialLocation(juce::File::tempDirectory)
+                          .getNonexistentChildFile("BufferedRecorderSampler", ".history");
+
+    auto history = std::make_unique<DiskHistory>(circularBuffer, file, (juce::int64) std::ceil(seconds * rate));
+
+    if (history->hasFailed())
+        return false;
+
+    diskHistory = std::move(history);
+    diskHistorySeconds = seconds;
+    return true;
+}
+
+void BufferedRecorderSamplerProcessor::enterSamplerMode()
+{
+    // The preview's source, possibly a copy of up to a minute of audio, goes with it
+    stopPreview();
+
+    // Calculate start and end sample in samples, on zero crossings so the sample doesn't click
+    int startSample = snapToZeroCrossing(startPosition);
+    int endSample = snapToZeroCrossing(endPosition);
+
+    if (endSample <= startSample)
+    {
+        startSample = juce::roundToInt(startPosition * trimmedCapture.getNumSamples());
+        endSample = juce::roundToInt(endPosition * trimmedCapture.getNumSamples());
+    }
+
+    int lengthInSamples = endSample - startSample;
+
+    // Create a new buffer for the trimmed portion
+    juce::AudioBuffer<float> finalBuffer;
+    finalBuffer.setSize(trimmedCapture.getNumChannels(), lengthInSamples);
+
+    // Copy the trimmed portion out of the capture; the sound takes this buffer over
+    trimmedCapture.copyTo(finalBuffer, 0, startSample, lengthInSamples);
+
+    // Loop the sustain at the detected pitch, so held notes outlast the capture
+    SustainLoopFinder::Loop sustainLoop;
+
+    if (sustainLoopEnabled)
+    {
+        const float fundamental = PitchConversion::frequencyFromMidiNote(getMostCommonNote() + getFineTuneCents() / 100.0f);
+        sustainLoop = SustainLoopFinder::find(finalBuffer, getSampleRate(), fundamental);
+        SustainLoopFinder::bakeCrossfade(finalBuffer, sustainLoop, juce::roundToInt(loopCrossfadeSeconds * getSampleRate()));
+    }
+
+    // Clear existing sounds and create new sampler sound
+    sampler.clearSounds();
+    sampler.addSound(new BufferedSamplerSound(std::move(finalBuffer), getMostCommonNote(), getFineTuneCents(), sustainLoop));
+
+    // Change state to sampling
+    state = PluginState::Sampling;
+}
+
+void BufferedRecorderSamplerProcessor::previewTrimmedSample()
+{
+    // Start the preview at the same zero crossing the sample will start on, from a source built off to the side
+    const int start = snapToZeroCrossing(startPosition);
+    auto source = std::make_unique<PreviewSource>();
+
+    if (trimmedCapture.isInMemory())
+    {
+        source->capture = trimmedCapture;
+        source->startPosition = start;
+    }
+    else
+    {
+        // The audio thread mustn't fault pages in from disk, so preview a copy of the range, up to a minute of it
+        const int end = juce::jlimit(start, trimmedCapture.getNumSamples(), juce::roundToInt(endPosition * trimmedCapture.getNumSamples()));
+        source->capture = AudioCapture::copyOf(trimmedCapture, start, juce::jmin(end - start, juce::roundToInt(60.0 * getSampleRate())));
+    }
+
+    publishPreviewSource(std::move(source));
+    isPreviewActive = true;
+
+    // Refresh the root note for the range; this never blocks on analysis
+    detectPitch();
+}
+
+void BufferedRecorderSamplerProcessor::stopPreview()
+{
+    isPreviewActive = false;
+    publishPreviewSource(nullptr);
+    releasePreviewSources(true);
+}
+
+const BufferedRecorderSamplerProcessor::PreviewSource* BufferedRecorderSamplerProcessor::acquirePreviewSource()
+{
+    // Mark the source in use, then check it is still the published one; the message thread only
+    // frees sources that are neither, so whichever it saw last, this one can't go while in use
+    for (;;)
+    {
+        const auto* source = publishedPreview.load();
+        previewInUse.store(source);
+
+        if (publishedPreview.load() == source)
+            return source;
+    }
+}
+
+void BufferedRecorderSamplerProcessor::publishPreviewSource(std::unique_ptr<PreviewSource> source)
+{
+    const PreviewSource* toPublish = source.get();
+
+    if (source != nullptr)
+    {
+        source->id = ++nextPreviewId;
+        previewSources.push_back(std::move(source));
+    }
+
+    // Whatever was published before is released once the audio thread is done with it
+    publishedPreview.store(toPublish);
+    releasePreviewSources(false);
+}
+
+void BufferedRecorderSamplerProcessor::releasePreviewSources(bool waitForAudioThread)
+{
+    // The audio thread only holds a source for the rest of one block, so waiting is short
+    if (waitForAudioThread)
+        while (previewInUse.load() != nullptr && previewInUse.load() != publishedPreview.load())
+            std::this_thread::yield();
+
+    const auto* published = publishedPreview.load();
+    const auto* inUse = previewInUse.load();
+
+    previewSources.erase(std::remove_if(previewSources.begin(), previewSources.end(), [&] (const std::unique_ptr<PreviewSource>& source)
+    {
+        return source.get() != published && source.get() != inUse;
+    }), previewSources.end());
+}
+
+void BufferedRecorderSamplerProcessor::detectPitch()
+{
+    if (trimmedCapture.getNumSamples() == 0)
+        return;
+
+    // Calculate start and end sample in samples
+    int totalSamples = trimmedCapture.getNumSamples();
+    int startSample = juce::roundToInt(startPosition * totalSamples);
+    int endSample = juce::roundToInt(endPosition * totalSamples);
+
+    // Brightness of the range comes from the shared spectra, once they're built
+    updateSpectralCentroid();
+
+    if (pitchIndex == nullptr)
+        pitchIndex = analysisService.getCompletedIndex();
+
+    // Without an index yet, let the background service work on this range and report back
+    if (pitchIndex == nullptr)
+    {
+        currentAnalysisJobId = analysisService.submit(startSample, endSample)->id;
+        return;
+    }
+
+    currentAnalysisJobId = 0;
+
+    // Statistics for the range come straight from the index
+    pitchIndex->getStatistics(startSample, endSample, noteStatistics);
+
+    updateMostCommonNote();
+}
+
+int BufferedRecorderSamplerProcessor::getMostCommonNote() const
+{
+    // While a background job is running for the current range, show its latest estimate
+    const auto estimate = analysisService.getLatestEstimate();
+
+    if (currentAnalysisJobId != 0 && estimate.jobId == currentAnalysisJobId && estimate.note >= 0)
+        return estimate.note;
+
+    return mostCommonNote;
 }
 
-void BufferedRecorderSamplerProcessor::setStateInformation(const void* data, int sizeInBytes)
+float BufferedRecorderSamplerProcessor::getFineTuneCents() const
 {
-    // You should use this method to restore your parameters from this memory block,
-    // whose contents will have been created by the getStateInformation() call.
+    const auto estimate = analysisService.getLatestEstimate();
+
+    if (currentAnalysisJobId != 0 && estimate.jobId == currentAnalysisJobId && estimate.note >= 0)
+        return estimate.fineTuneCents;
+
+    return fineTuneCents;
 }
 
-void BufferedRecorderSamplerProcessor::setBufferDuration(float seconds)
+PitchAnalysisService::Estimate BufferedRecorderSamplerProcessor::getPitchAnalysisStatus() const
 {
-    bufferDuration = seconds;
+    const auto estimate = analysisService.getLatestEstimate();
+
+    if (currentAnalysisJobId != 0 && estimate.jobId == currentAnalysisJobId)
+        return estimate;
+
+    // Either answered from the index, or the job hasn't published anything yet
+    PitchAnalysisService::Estimate status;
+    status.jobId = currentAnalysisJobId;
+    status.note = mostCommonNote;
+    status.fineTuneCents = fineTuneCents;
+    status.complete = currentAnalysisJobId == 0;
+    status.progress = status.complete ? 1.0f : 0.0f;
+    return status;
 }
 
-void BufferedRecorderSamplerProcessor::enterTrimMode()
+void BufferedRecorderSamplerProcessor::buildPitchIndex()
 {
-    state = PluginState::Trimming;
+    pitchIndex = nullptr;
+    currentAnalysisJobId = 0;
 
-    // Calculate start and end samples
-    int totalSamples = juce::roundToInt(bufferDuration * getSampleRate());
-    int startSample = 0;
-    int endSample = totalSamples;
+    // Use the frames tracked while recording instead of re-analysing
+    if (trimmedPitchTrackValid)
+    {
+        std::vector<PitchStatistics::Frame> frameData;
+        frameData.reserve(trimmedPitchTrack.size());
 
-    // Copy from circular buffer to trimmed buffer
-    trimmedBuffer.clear();
-    trimmedBuffer.setSize(2, endSample - startSample, false, true, true);
-    circularBuffer.copyTo(trimmedBuffer, startSample, endSample);
+        for (const auto& estimate : trimmedPitchTrack)
+            frameData.push_back(PitchStatistics::Frame::fromEstimate(estimate));
 
-    // Reset trim positions
-    startPosition = 0.0f;
-    endPosition = 1.0f;
+        auto index = std::make_shared<PitchNoteIndex>();
+        index->build(frameData, trimmedPitchTrackOffset, pitchTracker.getHopSize(), pitchTracker.getWindowSize());
+        pitchIndex = std::move(index);
+        return;
+    }
 
-    // Reset note histogram
-    noteHistogram.clear();
+    // Otherwise the whole capture is analysed in overlapping frames in the background;
+    // detectPitch() submits the first range
+    analysisService.setSource(trimmedCapture);
 }
 
-void BufferedRecorderSamplerProcessor::enterSamplerMode()
+void BufferedRecorderSamplerProcessor::setPitchRangePreset(PitchRangePreset newPreset)
 {
-    // Calculate start and end sample in samples
-    int totalSamples = trimmedBuffer.getNumSamples();
-    int startSample = juce::roundToInt(startPosition * totalSamples);
-    int endSample = juce::roundToInt(endPosition * totalSamples);
-    int lengthInSamples = endSample - startSample;
+    rangePreset = newPreset;
 
-    // Create a new buffer for the trimmed portion
-    juce::AudioBuffer<float> finalBuffer;
-    finalBuffer.setSize(trimmedBuffer.getNumChannels(), lengthInSamples);
+    auto presetConfig = PitchAnalysisConfig::forPreset(rangePreset, getSampleRate() > 0.0 ? getSampleRate() : 48000.0);
+    presetConfig.engine = analysisConfig.engine;
 
-    // Copy the data from the trimmed buffer to the final buffer
-    for (int channel = 0; channel < finalBuffer.getNumChannels(); ++channel)
-    {
-        finalBuffer.copyFrom(channel, 0,
-            trimmedBuffer,
-            channel,
-            startSample,
-            lengthInSamples);
-    }
+    setAnalysisConfig(presetConfig);
+    analysisConfigFromPreset = true;
+}
 
-    // Clear existing sounds and create new sampler sound
-    sampler.clearSounds();
-    sampler.addSound(new BufferedSamplerSound(finalBuffer, mostCommonNote));
+void BufferedRecorderSamplerProcessor::setPitchEngine(PitchEngineType newEngine)
+{
+    const bool fromPreset = analysisConfigFromPreset;
 
-    // Change state to sampling
-    state = PluginState::Sampling;
+    auto newConfig = analysisConfig;
+    newConfig.engine = newEngine;
+
+    setAnalysisConfig(newConfig);
+    analysisConfigFromPreset = fromPreset;
 }
 
-void BufferedRecorderSamplerProcessor::previewTrimmedSample()
+void BufferedRecorderSamplerProcessor::setAnalysisConfig(const PitchAnalysisConfig& newConfig)
 {
-    // Calculate start and end sample in samples
-    int totalSamples = trimmedBuffer.getNumSamples();
-    int startSample = juce::roundToInt(startPosition * totalSamples);
-    int endSample = juce::roundToInt(endPosition * totalSamples);
+    analysisConfig = newConfig;
+    analysisConfigFromPreset = false;
 
-    // Create a temporary buffer for pitch detection
-    juce::AudioBuffer<float> tempBuffer;
-    tempBuffer.setSize(1, endSample - startSample);
+    if (getSampleRate() <= 0.0)
+        return;
 
-    // Copy the first channel for pitch detection
-    tempBuffer.copyFrom(0, 0,
-        trimmedBuffer,
-        0,
-        startSample,
-        endSample - startSample);
+    // Offline analysis switches over right away. The recording tracker gets a detector
+    // built here and switches to it at the audio thread's next block; frames from before
+    // that don't cover a later capture, which falls back to analysis in the background.
+    // The onset gate follows at once.
+    analysisService.cancelAndWait();
+    onsetDetector.setSilenceThreshold(analysisConfig.silenceThreshold);
 
-    // Start the preview
-    isPreviewActive = true;
-    previewPosition = startSample;
+    pitchDetector = std::make_unique<PitchDetector>(getSampleRate(), analysisConfig);
+    parallelAnalyser.prepare(getSampleRate(), analysisConfig);
 
-    // Run pitch detection on the preview
-    detectPitch();
+    pitchTracker.setConfig(analysisConfig);
+    const int trackedLength = (int) compressedHistory.getMaxCapacity();
+    trimmedPitchTrack.reserve(trackedLength / StreamingPitchTracker::chooseHopSize(getSampleRate(), analysisConfig) + 1);
+
+    // Frames tracked for the current capture used the previous config, so re-analyse it
+    trimmedPitchTrackValid = false;
+
+    if (state == PluginState::Trimming)
+    {
+        buildPitchIndex();
+        updateSpectralFrames();
+        detectPitch();
+    }
 }
 
-void BufferedRecorderSamplerProcessor::stopPreview()
+void BufferedRecorderSamplerProcessor::updateSpectralFrames()
 {
-    isPreviewActive = false;
+    // Framed like the pitch analysis, so the centroid lines up with the pitch frames.
+    // Spectra of long captures from disk would outgrow the cache, so those go without.
+    if (spectralCache.fitsMemoryLimit(trimmedCapture.getNumSamples(), analysisConfig.windowSize, analysisConfig.hopSize))
+        spectralCache.prefetch(captureGeneration, trimmedCapture, analysisConfig.windowSize, analysisConfig.hopSize);
+
+    spectralFrames = nullptr;
+    spectralCentroid = 0.0f;
 }
 
-void BufferedRecorderSamplerProcessor::detectPitch()
+void BufferedRecorderSamplerProcessor::updateSpectralCentroid()
 {
-    if (trimmedBuffer.getNumSamples() == 0)
+    if (spectralFrames == nullptr)
         return;
 
-    // Calculate start and end sample in samples
-    int totalSamples = trimmedBuffer.getNumSamples();
-    int startSample = juce::roundToInt(startPosition * totalSamples);
-    int endSample = juce::roundToInt(endPosition * totalSamples);
-    int lengthInSamples = endSample - startSample;
-
-    // Analyze in chunks
-    const int chunkSize = 2048;
-    int numChunks = lengthInSamples / chunkSize;
+    const int totalSamples = trimmedCapture.getNumSamples();
+    spectralCentroid = spectralFrames->getCentroid(juce::roundToInt(startPosition * totalSamples),
+                                                   juce::roundToInt(endPosition * totalSamples), getSampleRate());
+}
 
-    // Process each chunk
-    for (int chunk = 0; chunk < numChunks; ++chunk)
+float BufferedRecorderSamplerProcessor::getSpectralCentroid()
+{
+    // The spectra are built in the background after each capture; pick them up once ready
+    if (spectralFrames == nullptr && state == PluginState::Trimming)
     {
-        // Create a temporary buffer for the chunk
-        float chunkData[chunkSize];
-
-        // Copy data from the first channel
-        for (int i = 0; i < chunkSize; ++i)
-        {
-            int sampleIndex = startSample + chunk * chunkSize + i;
-            chunkData[i] = trimmedBuffer.getSample(0, sampleIndex);
-        }
-
-        // Detect pitch for this chunk
-        float frequency = pitchDetector->detectPitch(chunkData, chunkSize);
+        spectralFrames = spectralCache.findFrames(captureGeneration, analysisConfig.windowSize, analysisConfig.hopSize);
+        updateSpectralCentroid();
+    }
 
-        // Convert to MIDI note
-        int midiNote = pitchDetector->midiNoteFromFrequency(frequency);
+    return spectralCentroid;
+}
 
-        // Add to histogram if valid
-        if (midiNote >= 0 && midiNote < 128)
-        {
-            if (noteHistogram.find(midiNote) == noteHistogram.end())
-                noteHistogram[midiNote] = 1;
-            else
-                noteHistogram[midiNote]++;
-        }
-    }
+void BufferedRecorderSamplerProcessor::updateMostCommonNote()
+{
+    // Find the most common note and its tuning; keep the last ones if nothing was voiced
+    const int note = noteStatistics.getMostCommonNote();
 
-    // Find most common note
-    int maxCount = 0;
-    for (const auto& entry : noteHistogram)
+    if (note >= 0)
     {
-        if (entry.second > maxCount)
-        {
-            maxCount = entry.second;
-            mostCommonNote = entry.first;
-        }
+        mostCommonNote = note;
+        fineTuneCents = noteStatistics.getFineTuneCents();
     }
 }
 
@@ -728,10 +6536,16 @@ BufferedRecorderSamplerEditor::BufferedRecorderSamplerEditor(BufferedRecorderSam
     addAndMakeVisible(buffer10sButton);
     addAndMakeVisible(buffer30sButton);
     addAndMakeVisible(buffer60sButton);
+    addAndMakeVisible(buffer2mButton);
+    addAndMakeVisible(buffer60mButton);
+    addAndMakeVisible(diskHistoryToggle);
 
     buffer10sButton.addListener(this);
     buffer30sButton.addListener(this);
     buffer60sButton.addListener(this);
+    buffer2mButton.addListener(this);
+    buffer60mButton.addListener(this);
+    diskHistoryToggle.addListener(this);
 
     // Trimming controls
     addAndMakeVisible(startSlider);
@@ -739,6 +6553,23 @@ BufferedRecorderSamplerEditor::BufferedRecorderSamplerEditor(BufferedRecorderSam
     addAndMakeVisible(previewButton);
     addAndMakeVisible(doneButton);
     addAndMakeVisible(pitchLabel);
+    addAndMakeVisible(centroidLabel);
+    addAndMakeVisible(rangeBox);
+
+    // Pitch range presets; item IDs are the PitchRangePreset values + 1
+    rangeBox.addItem("Full Range", 1 + (int) PitchRangePreset::Full);
+    rangeBox.addItem("Bass", 1 + (int) PitchRangePreset::Bass);
+    rangeBox.addItem("Vocal", 1 + (int) PitchRangePreset::Vocal);
+    rangeBox.addItem("Lead", 1 + (int) PitchRangePreset::Lead);
+    rangeBox.setSelectedId(1 + (int) processor.getPitchRangePreset(), juce::dontSendNotification);
+    rangeBox.addListener(this);
+
+    // Pitch engines; item IDs are the PitchEngineType values + 1
+    addAndMakeVisible(engineBox);
+    engineBox.addItem("YIN", 1 + (int) PitchEngineType::YIN);
+    engineBox.addItem("McLeod", 1 + (int) PitchEngineType::McLeod);
+    engineBox.setSelectedId(1 + (int) processor.getPitchEngine(), juce::dontSendNotification);
+    engineBox.addListener(this);
 
     startSlider.setRange(0.0, 1.0);
     endSlider.setRange(0.0, 1.0);
@@ -825,6 +6656,9 @@ void BufferedRecorderSamplerEditor::resized()
     buffer10sButton.setBounds(margin, 80, buttonWidth, buttonHeight);
     buffer30sButton.setBounds(margin * 2 + buttonWidth, 80, buttonWidth, buttonHeight);
     buffer60sButton.setBounds(margin * 3 + buttonWidth * 2, 80, buttonWidth, buttonHeight);
+    buffer60mButton.setBounds(margin * 4 + buttonWidth * 3, 80, buttonWidth, buttonHeight);
+    diskHistoryToggle.setBounds(margin, 120, buttonWidth * 3, buttonHeight);
+    buffer2mButton.setBounds(margin * 4 + buttonWidth * 3, 120, buttonWidth, buttonHeight);
 
     // Trim controls positioning
     startSlider.setBounds(margin, 250, getWidth() - margin * 2, buttonHeight);
@@ -832,27 +6666,44 @@ void BufferedRecorderSamplerEditor::resized()
     previewButton.setBounds(margin, 330, buttonWidth, buttonHeight);
     doneButton.setBounds(getWidth() - margin - buttonWidth, 330, buttonWidth, buttonHeight);
     pitchLabel.setBounds(margin * 2 + buttonWidth, 330, getWidth() - margin * 3 - buttonWidth * 2, buttonHeight);
+    rangeBox.setBounds(getWidth() - margin - buttonWidth * 2, 210, buttonWidth * 2, buttonHeight);
+    engineBox.setBounds(getWidth() - margin * 2 - buttonWidth * 3, 210, buttonWidth, buttonHeight);
+    centroidLabel.setBounds(margin, 210, getWidth() - margin * 4 - buttonWidth * 3, buttonHeight);
 
     // Sampler info positioning
     samplerInfoLabel.setBounds(margin, 150, getWidth() - margin * 2, buttonHeight * 2);
+
+    updateWaveformPath();
 }
 
 void BufferedRecorderSamplerEditor::buttonClicked(juce::Button* button)
 {
     if (button == &buffer10sButton)
     {
-        processor.setBufferDuration(10.0f);
-        processor.enterTrimMode();
+        enterTrimMode(10.0f);
     }
     else if (button == &buffer30sButton)
     {
-        processor.setBufferDuration(30.0f);
-        processor.enterTrimMode();
+        enterTrimMode(30.0f);
     }
     else if (button == &buffer60sButton)
     {
-        processor.setBufferDuration(60.0f);
-        processor.enterTrimMode();
+        enterTrimMode(60.0f);
+    }
+    else if (button == &buffer2mButton)
+    {
+        // Reaches back as far as the compressed history goes, if that is less
+        enterTrimMode(120.0f);
+    }
+    else if (button == &buffer60mButton)
+    {
+        enterTrimMode(3600.0f);
+    }
+    else if (button == &diskHistoryToggle)
+    {
+        // The file holds what is recorded from now on, plus what the RAM ring already has
+        if (! processor.setDiskHistorySeconds(diskHistoryToggle.getToggleState() ? 3600.0 : 0.0))
+            diskHistoryToggle.setToggleState(false, juce::dontSendNotification);
     }
     else if (button == &previewButton)
     {
@@ -866,6 +6717,49 @@ void BufferedRecorderSamplerEditor::buttonClicked(juce::Button* button)
     updateControlsVisibility();
 }
 
+void BufferedRecorderSamplerEditor::enterTrimMode(float bufferSeconds)
+{
+    processor.setBufferDuration(bufferSeconds);
+    processor.enterTrimMode();
+
+    // Show the trim points the processor proposed from the capture's onsets
+    startSlider.setValue(processor.getStartPosition(), juce::dontSendNotification);
+    endSlider.setValue(processor.getEndPosition(), juce::dontSendNotification);
+}
+
+void BufferedRecorderSamplerEditor::updateWaveformPath()
+{
+    const auto& overview = processor.getWaveformOverview();
+
+    if (processor.getCaptureGeneration() == waveformGeneration && getWidth() == waveformWidth)
+        return;
+
+    waveformGeneration = processor.getCaptureGeneration();
+    waveformWidth = getWidth();
+    waveformPath.clear();
+
+    if (overview.isEmpty() || waveformWidth <= 0)
+        return;
+
+    const float height = 100.0f;
+    const float centerY = 150.0f;
+
+    // One vertical stroke per pixel from the lowest to the highest sample in its columns
+    waveformPath.startNewSubPath(0, centerY);
+
+    for (int x = 0; x < waveformWidth; ++x)
+    {
+        const int firstColumn = (int) ((juce::int64) WaveformOverview::numColumns * x / waveformWidth);
+        const int endColumn = juce::jmax(firstColumn + 1, (int) ((juce::int64) WaveformOverview::numColumns * (x + 1) / waveformWidth));
+        const auto range = overview.getRange(firstColumn, endColumn);
+
+        waveformPath.lineTo((float) x, centerY - range.getEnd() * height);
+        waveformPath.lineTo((float) x, centerY - range.getStart() * height);
+    }
+
+    waveformPath.lineTo((float) waveformWidth, centerY);
+}
+
 void BufferedRecorderSamplerEditor::sliderValueChanged(juce::Slider* slider)
 {
     if (slider == &startSlider)
@@ -891,9 +6785,21 @@ void BufferedRecorderSamplerEditor::sliderValueChanged(juce::Slider* slider)
         }
     }
 
+    // Root note of the new range is a cheap index lookup, so keep it live while dragging
+    if (processor.getState() == PluginState::Trimming)
+        processor.detectPitch();
+
     repaint();
 }
 
+void BufferedRecorderSamplerEditor::comboBoxChanged(juce::ComboBox* comboBox)
+{
+    if (comboBox == &rangeBox)
+        processor.setPitchRangePreset(static_cast<PitchRangePreset>(rangeBox.getSelectedId() - 1));
+    else if (comboBox == &engineBox)
+        processor.setPitchEngine(static_cast<PitchEngineType>(engineBox.getSelectedId() - 1));
+}
+
 void BufferedRecorderSamplerEditor::timerCallback()
 {
     // Update state-dependent UI
@@ -902,56 +6808,45 @@ void BufferedRecorderSamplerEditor::timerCallback()
     // Update waveform visualization if in trimming mode
     if (processor.getState() == PluginState::Trimming)
     {
-        auto& buffer = processor.getTrimmedBuffer();
-
-        if (buffer.getNumSamples() > 0)
-        {
-            // Create a path for the waveform
-            waveformPath.clear();
-
-            const float height = 100.0f;
-            const float centerY = 150.0f;
-
-            // Scale for drawing
-            const float xScale = getWidth() / static_cast<float>(buffer.getNumSamples());
-
-            // Start path at first sample
-            waveformPath.startNewSubPath(0, centerY);
-
-            // Add points for samples
-            for (int i = 0; i < buffer.getNumSamples(); i += 128) // Downsample for drawing
-            {
-                float sample = buffer.getSample(0, i); // Just use first channel
-                float y = centerY - sample * height;
-                float x = i * xScale;
-
-                waveformPath.lineTo(x, y);
-            }
-
-            // End path at last sample
-            waveformPath.lineTo(getWidth(), centerY);
-        }
+        updateWaveformPath();
 
         // Update pitch label
         juce::String pitchText = "Detected Pitch: ";
 
-        if (processor.getMostCommonNote() >= 0)
+        // Lock-free read of the latest estimate, which may still be refining
+        const auto status = processor.getPitchAnalysisStatus();
+        const int note = processor.getMostCommonNote();
+
+        if (note >= 0)
         {
             auto noteString = juce::MidiMessage::getMidiNoteName(
-                processor.getMostCommonNote(),
+                note,
                 true,
                 true,
                 3
             );
 
             pitchText += noteString;
+
+            // Tuning relative to the note, to the nearest cent
+            const int cents = juce::roundToInt(processor.getFineTuneCents());
+            if (cents != 0)
+                pitchText += (cents > 0 ? " +" : " ") + juce::String(cents) + " ct";
         }
         else
         {
             pitchText += "None";
         }
 
+        if (! status.complete)
+            pitchText += " (analysing " + juce::String(juce::roundToInt(status.progress * 100.0f)) + "%)";
+
         pitchLabel.setText(pitchText, juce::dontSendNotification);
+
+        // Spectral centroid of the trim range
+        const float centroid = processor.getSpectralCentroid();
+        centroidLabel.setText("Brightness: " + (centroid > 0.0f ? juce::String(juce::roundToInt(centroid)) + " Hz" : juce::String("-")),
+                              juce::dontSendNotification);
     }
 
     repaint();
@@ -966,12 +6861,20 @@ void BufferedRecorderSamplerEditor::updateControlsVisibility()
         buffer10sButton.setVisible(true);
         buffer30sButton.setVisible(true);
         buffer60sButton.setVisible(true);
+        buffer2mButton.setVisible(true);
+        buffer60mButton.setVisible(true);
+        buffer60mButton.setEnabled(processor.isDiskHistoryReady());
+        diskHistoryToggle.setToggleState(processor.getDiskHistorySeconds() > 0.0, juce::dontSendNotification);
+        diskHistoryToggle.setVisible(true);
 
         startSlider.setVisible(false);
         endSlider.setVisible(false);
         previewButton.setVisible(false);
         doneButton.setVisible(false);
         pitchLabel.setVisible(false);
+        centroidLabel.setVisible(false);
+        rangeBox.setVisible(false);
+        engineBox.setVisible(false);
 
         samplerInfoLabel.setVisible(false);
         break;
@@ -980,12 +6883,18 @@ void BufferedRecorderSamplerEditor::updateControlsVisibility()
         buffer10sButton.setVisible(false);
         buffer30sButton.setVisible(false);
         buffer60sButton.setVisible(false);
+        buffer2mButton.setVisible(false);
+        buffer60mButton.setVisible(false);
+        diskHistoryToggle.setVisible(false);
 
         startSlider.setVisible(true);
         endSlider.setVisible(true);
         previewButton.setVisible(true);
         doneButton.setVisible(true);
         pitchLabel.setVisible(true);
+        centroidLabel.setVisible(true);
+        rangeBox.setVisible(true);
+        engineBox.setVisible(true);
 
         samplerInfoLabel.setVisible(false);
         break;
@@ -994,12 +6903,18 @@ void BufferedRecorderSamplerEditor::updateControlsVisibility()
         buffer10sButton.setVisible(false);
         buffer30sButton.setVisible(false);
         buffer60sButton.setVisible(false);
+        buffer2mButton.setVisible(false);
+        buffer60mButton.setVisible(false);
+        diskHistoryToggle.setVisible(false);
 
         startSlider.setVisible(false);
         endSlider.setVisible(false);
         previewButton.setVisible(false);
         doneButton.setVisible(false);
         pitchLabel.setVisible(false);
+        centroidLabel.setVisible(false);
+        rangeBox.setVisible(false);
+        engineBox.setVisible(false);
 
         samplerInfoLabel.setVisible(true);
         samplerInfoLabel.setText("Sampler Mode Active\nRoot Note: " +
@@ -1025,15 +6940,17 @@ void BufferedSamplerVoice::startNote(int midiNoteNumber, float velocity,
         // Get the root note
         rootNote = samplerSound->getRootNote();
 
-        // Calculate playback rate based on note difference
-        double ratio = std::pow(2.0, (midiNoteNumber - rootNote) / 12.0);
+        // Calculate playback rate based on note difference, taking out the recording's detuning
+        double ratio = std::pow(2.0, (midiNoteNumber - rootNote - samplerSound->getRootCents() / 100.0) / 12.0);
         rate = ratio;
 
-        // Get the buffer
+        // Get the buffer and its sustain loop
         sampleBuffer = &samplerSound->getSampleBuffer();
+        loopStart = samplerSound->getSustainLoop().start;
+        loopEnd = samplerSound->getSustainLoop().end;
 
         // Reset position
-        sourceSamplePosition = 0;
+        sourceSamplePosition = 0.0;
 
         // Set level based on velocity
         level = velocity * 0.15;
@@ -1091,8 +7008,14 @@ void BufferedSamplerVoice::renderNextBlock(juce::AudioBuffer<float>& outputBuffe
     if (bufferSize <= 0)
         return;
 
+    const bool looping = loopEnd > loopStart && loopEnd <= bufferSize;
+
     while (--numSamples >= 0)
     {
+        // Wrap around the sustain loop, for as long as the voice sounds
+        if (looping && sourceSamplePosition >= loopEnd)
+            sourceSamplePosition -= loopEnd - loopStart;
+
         // Get the current sample position
         const int pos = static_cast<int>(sourceSamplePosition);
 
@@ -1107,8 +7030,8 @@ void BufferedSamplerVoice::renderNextBlock(juce::AudioBuffer<float>& outputBuffe
         const float alpha = static_cast<float>(sourceSamplePosition - pos);
         const float invAlpha = 1.0f - alpha;
 
-        // Next sample (for interpolation)
-        const int nextPos = pos + 1 < bufferSize ? pos + 1 : pos;
+        // Next sample (for interpolation), which follows the loop end with the loop start
+        const int nextPos = looping && pos + 1 == loopEnd ? loopStart : (pos + 1 < bufferSize ? pos + 1 : pos);
 
         // Get the interpolated sample values
         float l = (inL[pos] * invAlpha + inL[nextPos] * alpha);
@@ -1146,4 +7069,367 @@ void BufferedSamplerVoice::renderNextBlock(juce::AudioBuffer<float>& outputBuffe
 juce::AudioProcessor* JUCE_CALLTYPE createPluginFilter()
 {
     return new BufferedRecorderSamplerProcessor();
-}
\ No newline at end of file
+}
+#if PITCHSAMPLER_BENCHMARK
+//==============================================================================
+/**
+ * Engine benchmark: build this file as a console target with
+ * PITCHSAMPLER_BENCHMARK=1. For every engine, directly and behind the
+ * decimating front-end, it reports the time per frame and the gross error
+ * rate (unvoiced, or more than 20% off) on a synthetic tone corpus. It then
+ * checks the lossless history codec round-trips and that the recording ring
+ * and both histories freeze exact spans, and exits non-zero if either fails.
+ */
+#include <chrono>
+#include <cstdio>
+
+namespace PitchEngineBenchmark
+{
+    struct Result
+    {
+        double nanosecondsPerFrame = 0.0;
+        double grossErrorRate = 0.0;
+    };
+
+    /** Harmonic tones from 55 Hz to 1760 Hz with varying brightness and a little noise */
+    inline std::vector<std::vector<float>> makeCorpus(double sampleRate, int windowSize, std::vector<float>& frequencies)
+    {
+        std::vector<std::vector<float>> corpus;
+        juce::Random random(1234);
+
+        for (float frequency = 55.0f; frequency <= 1760.0f; frequency *= 1.0293f) // about a half semitone
+        {
+            for (int brightness = 1; brightness <= 3; ++brightness)
+            {
+                std::vector<float> frame((size_t) windowSize);
+                const double phase = random.nextDouble() * juce::MathConstants<double>::twoPi;
+
+                for (int i = 0; i < windowSize; ++i)
+                {
+                    double value = 0.0;
+                    for (int harmonic = 1; harmonic <= 8; ++harmonic)
+                        value += std::pow(0.3 * brightness, harmonic - 1)
+                                   * std::sin(juce::MathConstants<double>::twoPi * frequency * harmonic * i / sampleRate + phase * harmonic);
+
+                    frame[(size_t) i] = (float) (0.3 * value) + 0.01f * (random.nextFloat() * 2.0f - 1.0f);
+                }
+
+                corpus.push_back(std::move(frame));
+                frequencies.push_back(frequency);
+            }
+        }
+
+        return corpus;
+    }
+
+    template <typename Analyse>
+    Result measure(const std::vector<std::vector<float>>& corpus, const std::vector<float>& frequencies, int repeats, Analyse&& analyse)
+    {
+        Result result;
+        int grossErrors = 0;
+
+        for (size_t i = 0; i < corpus.size(); ++i)
+        {
+            const auto estimate = analyse(corpus[i].data(), (int) corpus[i].size());
+            if (! estimate.voiced || std::abs(estimate.frequency - frequencies[i]) > 0.2f * frequencies[i])
+                ++grossErrors;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        for (int repeat = 0; repeat < repeats; ++repeat)
+            for (const auto& frame : corpus)
+                analyse(frame.data(), (int) frame.size());
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+
+        result.nanosecondsPerFrame = (double) std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()
+                                       / ((double) repeats * (double) corpus.size());
+        result.grossErrorRate = (double) grossErrors / (double) corpus.size();
+        return result;
+    }
+
+    inline void run(double sampleRate)
+    {
+        const auto config = PitchAnalysisConfig::forPreset(PitchRangePreset::Full, sampleRate);
+
+        std::vector<float> frequencies;
+        const auto corpus = makeCorpus(sampleRate, config.windowSize, frequencies);
+
+        std::printf("%.0f Hz, window %d, %d frames\n", sampleRate, config.windowSize, (int) corpus.size());
+        std::printf("%-8s %-10s %14s %12s\n", "engine", "front-end", "ns/frame", "gross err %");
+
+        for (auto type : { PitchEngineType::YIN, PitchEngineType::McLeod })
+        {
+            auto engineConfig = config;
+            engineConfig.engine = type;
+
+            auto engine = PitchEngine::create(sampleRate, engineConfig);
+            const auto direct = measure(corpus, frequencies, 20, [&](const float* frame, int size)
+            {
+                return engine->analysePitch(frame, size);
+            });
+
+            DecimatingPitchDetector decimating(sampleRate, engineConfig);
+            const auto decimated = measure(corpus, frequencies, 20, [&](const float* frame, int size)
+            {
+                return decimating.analysePitch(frame, nullptr, size);
+            });
+
+            std::printf("%-8s %-10s %14.0f %12.2f\n", engine->getName(), "direct", direct.nanosecondsPerFrame, 100.0 * direct.grossErrorRate);
+            std::printf("%-8s x%-9d %14.0f %12.2f\n", engine->getName(), decimating.getDecimationFactor(),
+                        decimated.nanosecondsPerFrame, 100.0 * decimated.grossErrorRate);
+        }
+    }
+}
+
+/**
+ * Round trip of LosslessAudioCodec over signals covering each block type and
+ * its edge cases. Reports the compression ratio of each; any sample that
+ * doesn't come back bit for bit fails the run.
+ */
+namespace LosslessCodecCheck
+{
+    inline float quantise(double value, int bits)
+    {
+        const double scale = std::ldexp(1.0, bits - 1);
+        return (float) (std::round(value * scale) / scale);
+    }
+
+    inline bool run()
+    {
+        const int numSamples = AudioSegment::size;
+        juce::Random random(99);
+        bool allExact = true;
+
+        const std::pair<const char*, std::function<float(int)>> signals[] =
+        {
+            { "silence",      [] (int) { return 0.0f; } },
+            { "signed zeros", [] (int i) { return i % 3 == 0 ? -0.0f : 0.0f; } },
+            { "tone 16 bit",  [] (int i) { return quantise(0.5 * std::sin(i * 0.031), 16); } },
+            { "tone 24 bit",  [&] (int i) { return quantise(0.5 * std::sin(i * 0.031) + 0.001 * (random.nextDouble() - 0.5), 24); } },
+            { "noise 24 bit", [&] (int) { return quantise(random.nextDouble() - 0.5, 24); } },
+            { "float noise",  [&] (int) { return (float) (random.nextDouble() - 0.5) * 0.3f; } },
+            { "full scale",   [] (int i) { return (i & 1) ? 1.0f : -1.0f; } },
+            { "large",        [] (int i) { return quantise(100.0 * std::sin(i * 0.3), 24); } },
+            { "denormals",    [] (int i) { return (float) (1.0e-40 * (i % 7)); } },
+            { "odd values",   [] (int i) { return i == 5 ? -0.0f : i == 4000 ? std::numeric_limits<float>::quiet_NaN()
+                                                  : i == 9000 ? std::numeric_limits<float>::infinity() : quantise(std::sin(i * 0.05), 24); } },
+        };
+
+        std::printf("%-14s %8s %10s\n", "signal", "ratio", "mismatches");
+
+        for (const auto& signal : signals)
+        {
+            std::vector<float> input((size_t) numSamples), output((size_t) numSamples);
+            for (int i = 0; i < numSamples; ++i)
+                input[(size_t) i] = signal.second(i);
+
+            std::vector<juce::uint8> coded;
+            LosslessAudioCodec::encode(input.data(), numSamples, coded);
+            LosslessAudioCodec::decode(coded.data(), coded.size(), output.data(), numSamples);
+
+            int mismatches = 0;
+            for (int i = 0; i < numSamples; ++i)
+                if (std::memcmp(&input[(size_t) i], &output[(size_t) i], sizeof(float)) != 0)
+                    ++mismatches;
+
+            allExact = allExact && mismatches == 0 && coded.size() <= LosslessAudioCodec::getMaxEncodedSize(numSamples);
+            std::printf("%-14s %8.2f %10d\n", signal.first, (double) numSamples * sizeof(float) / (double) coded.size(), mismatches);
+        }
+
+        return allExact;
+    }
+}
+
+namespace HistoryCheck
+{
+    /** The ramp written at an absolute position; positions before the first write read as silence */
+    inline float rampSample(juce::int64 position, int channel)
+    {
+        if (position < 0)
+            return 0.0f;
+
+        const float value = (float) (position % 1000003) + 1.0f;
+        return channel == 0 ? value : -0.5f * value;
+    }
+
+    struct Tally
+    {
+        const char* name;
+        int captures = 0, failures = 0;
+    };
+
+    /** True if the capture starts at expectedStart, is expectedLength long and holds the ramp sample for sample */
+    inline bool holdsRamp(const AudioCapture& capture, juce::int64 expectedStart, int expectedLength, int numChannels)
+    {
+        if (capture.getStartPosition() != expectedStart || capture.getNumSamples() != expectedLength
+             || capture.getNumChannels() != numChannels)
+            return false;
+
+        juce::AudioBuffer<float> copy(numChannels, juce::jmax(1, expectedLength));
+        capture.copyTo(copy, 0, 0, expectedLength);
+
+        for (int channel = 0; channel < numChannels; ++channel)
+        {
+            const float* data = copy.getReadPointer(channel);
+
+            for (int i = 0; i < expectedLength; ++i)
+                if (data[i] != rampSample(expectedStart + i, channel))
+                    return false;
+        }
+
+        return true;
+    }
+
+    /** Polls until condition() holds, for up to ten seconds */
+    template <typename Condition>
+    bool waitFor(Condition&& condition)
+    {
+        for (int attempt = 0; attempt < 10000; ++attempt)
+        {
+            if (condition())
+                return true;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        return condition();
+    }
+
+    /**
+     * Writes a ramp in blocks of awkward sizes and, after each block, freezes every
+     * interesting span length from the ring, the compressed history and the disk
+     * history, checking positions and content sample for sample. A few captures are
+     * kept across the next block to check pinned segments stay intact while the
+     * writer moves on.
+     */
+    inline bool run()
+    {
+        constexpr int numChannels = 2;
+        constexpr int segment = AudioSegment::size;
+
+        CircularAudioBuffer ring(numChannels, 5 * segment + 1234);
+        CompressedHistory compressed(ring, 2 * segment, 12 * segment, 12 * segment);
+
+        const auto historyFile = juce::File::getSpecialLocation(juce::File::tempDirectory)
+                                     .getNonexistentChildFile("BufferedRecorderSamplerCheck", ".history");
+        DiskHistory disk(ring, historyFile, 16 * segment);
+        const bool useDisk = waitFor([&] { return disk.isReady() || disk.hasFailed(); }) && disk.isReady();
+
+        if (! useDisk)
+            std::printf("disk history unavailable, checking RAM only\n");
+
+        Tally ringTally { "ring" }, spanTally { "ring spans" }, compressedTally { "compressed" }, diskTally { "disk" }, heldTally { "held" };
+        bool kept = true;
+
+        auto check = [] (Tally& tally, const AudioCapture& capture, juce::int64 start, int length)
+        {
+            ++tally.captures;
+
+            if (! holdsRamp(capture, start, length, numChannels))
+                ++tally.failures;
+        };
+
+        const int blockSizes[] = { 613, 1, 4096, segment, 1500, segment + 7, segment - 1, 7, 2 * segment - 3 };
+        std::vector<std::pair<AudioCapture, juce::int64>> held;
+        juce::AudioBuffer<float> block(numChannels, 2 * segment);
+        juce::int64 total = 0;
+
+        for (int blockIndex = 0; total < 40 * (juce::int64) segment; ++blockIndex)
+        {
+            // Step 1: Write the next block of the ramp
+            const int blockSize = blockSizes[blockIndex % (int) std::size(blockSizes)];
+            block.setSize(numChannels, blockSize, false, false, true);
+
+            for (int channel = 0; channel < numChannels; ++channel)
+                for (int i = 0; i < blockSize; ++i)
+                    block.setSample(channel, i, rampSample(total + i, channel));
+
+            ring.write(block);
+            total += blockSize;
+
+            // Step 2: Captures kept from the previous block must not have moved
+            for (const auto& capture : held)
+                check(heldTally, capture.first, capture.second, capture.first.getNumSamples());
+
+            held.clear();
+
+            // Step 3: Let the histories catch up with every segment they should hold by now
+            kept = kept && waitFor([&] { return compressed.getStoredEnd() >= AudioSegment::indexOf(total - 2 * segment) * segment; });
+
+            if (useDisk)
+                kept = kept && waitFor([&] { return disk.getStoredEnd() >= AudioSegment::indexOf(total) * segment; });
+
+            // Step 4: Every span length around the segment and ring sizes, from each source
+            const int ringSize = ring.getSize();
+            const int compressedCapacity = (int) compressed.getCapacity();
+            const int diskCapacity = useDisk ? (int) disk.getCapacity() : 0;
+            const int lengths[] = { 1, 2, 613, segment - 1, segment, segment + 1, 2 * segment + 17, 3 * segment + 5,
+                                    ringSize - 1, ringSize, ringSize + 1, 8 * segment - 1, compressedCapacity, diskCapacity };
+
+            for (int length : lengths)
+            {
+                if (length <= 0)
+                    continue;
+
+                if (length <= ringSize)
+                {
+                    const auto capture = ring.freezeLatest(length);
+                    check(ringTally, capture, total - length, length);
+
+                    if (length == ringSize)
+                        held.emplace_back(capture, total - length);
+                }
+
+                if (length <= compressedCapacity)
+                {
+                    const auto capture = compressed.freezeLatest(length);
+                    check(compressedTally, capture, total - length, length);
+
+                    if (length == compressedCapacity)
+                        held.emplace_back(capture, total - length);
+                }
+
+                // Disk captures aren't held: the history skips slots a capture still reads
+                if (length <= diskCapacity)
+                    check(diskTally, disk.freezeLatest(length), total - length, length);
+            }
+
+            // Step 5: Spans from given positions, which must come back empty once any of them is out of the ring
+            for (juce::int64 start : { total - ringSize, total - ringSize + 1, AudioSegment::indexOf(total - 1) * segment - 1, total - 1 })
+            {
+                const int length = (int) juce::jmin((juce::int64) 3 * segment + 11, total - start);
+                check(spanTally, ring.freeze(start, length), start, length);
+            }
+
+            ++spanTally.captures;
+            if (ring.freeze(total - ringSize - 1, 10).getNumSamples() != 0 || ring.freeze(total - 5, 10).getNumSamples() != 0)
+                ++spanTally.failures;
+        }
+
+        std::printf("%-14s %8s %10s\n", "history", "captures", "mismatches");
+
+        bool allExact = kept;
+
+        for (const auto* tally : { &ringTally, &spanTally, &compressedTally, &diskTally, &heldTally })
+        {
+            allExact = allExact && tally->failures == 0;
+            std::printf("%-14s %8d %10d\n", tally->name, tally->captures, tally->failures);
+        }
+
+        if (! kept)
+            std::printf("a history fell behind the writer\n");
+
+        return allExact;
+    }
+}
+
+int main()
+{
+    for (double sampleRate : { 44100.0, 48000.0, 96000.0 })
+        PitchEngineBenchmark::run(sampleRate);
+
+    const bool codecExact = LosslessCodecCheck::run();
+    const bool historyExact = HistoryCheck::run();
+    return codecExact && historyExact ? 0 : 1;
+}
+#endif